@@ -19,6 +19,12 @@
 #ifndef SHELL_H
 #define SHELL_H
 
+#include <setjmp.h>
+
+#if defined(ARDUINO_ARCH_AVR)
+#include <avr/sleep.h>
+#endif
+
 /**
  * Application script dictionary entry (in program memory).
  */
@@ -48,15 +54,54 @@ struct script_t {
  */
 #define SCRIPT_NULL() { NULL, NULL }
 
+/**
+ * Shell instruction subsets (feature mask). Operations in disabled
+ * subsets are not compiled and fail as unknown operation codes.
+ */
+enum {
+  SHELL_PINS = 0x01,		//!< Digital pins; H I L O R U W X.
+  SHELL_ANALOG = 0x02,		//!< Analog pins; A P.
+  SHELL_DICTIONARY = 0x04,	//!< Eeprom dictionary; ; a f t z Y Va Ji Jv..
+  SHELL_OUTPUT = 0x08,		//!< Output formatting; ( . ? b m v S Gf Gt.
+  SHELL_FRAMES = 0x10,		//!< Stack frames; \ $.
+  SHELL_ALL = 0xff,		//!< All instruction subsets.
+  SHELL_INLINE = 0x100		//!< Inline short functions (not in ALL).
+};
+
+/**
+ * Eeprom size (bytes). The dictionary and functions are not written
+ * beyond the end of the eeprom.
+ */
+#if defined(E2END)
+#define SHELL_EEPROM_SIZE (E2END + 1)
+#else
+#define SHELL_EEPROM_SIZE 1024
+#endif
+
+/**
+ * Default max number of dictionary entries. An entry is eight bytes
+ * of eeprom (on AVR); a quarter of the eeprom is used for entries.
+ */
+#define SHELL_DICT_MAX (SHELL_EEPROM_SIZE / 32)
+
 /**
  * Script Shell with stack machine instruction set. Instructions are
  * printable characters so that command lines and scripts can be
  * written directly.
  * @param[in] STACK_MAX max stack depth (default 16).
- * @param[in] VAR_MAX max number of variables (default 32).
+ * @param[in] VAR_MAX max number of variables (default 32, max 254).
  * @param[in] FULL_OP_NAMES trace with operation name (default true).
+ * @param[in] DICT_MAX max number of dictionary entries (default
+ *   SHELL_DICT_MAX, 32 with 1 Kbyte eeprom).
+ * @param[in] ARENA_MAX threaded code arena size in cells (default 0).
+ * @param[in] FEATURES instruction subsets (default SHELL_ALL).
  */
-template<int STACK_MAX = 16, int VAR_MAX = 32, bool FULL_OP_NAMES = true>
+template<int STACK_MAX = 16,
+	 int VAR_MAX = 32,
+	 bool FULL_OP_NAMES = true,
+	 int DICT_MAX = SHELL_DICT_MAX,
+	 int ARENA_MAX = 0,
+	 int FEATURES = SHELL_ALL>
 class Shell {
 public:
   /**
@@ -66,9 +111,13 @@ public:
    */
   Shell(Stream& ios, const script_t* scripts = NULL) :
     m_scripts(scripts),
-    m_dp((char*) sizeof(m_dp) + sizeof(m_entries) + (sizeof(dict_t) * VAR_MAX)),
-    m_dict((dict_t*) sizeof(m_dp) + sizeof(m_entries)),
+    m_dp((char*) HEADER_SIZE + (sizeof(dict_t) * DICT_MAX)),
+    m_dict((dict_t*) HEADER_SIZE),
     m_entries(0),
+    m_root(NO_ENTRY),
+    m_current(NO_ENTRY),
+    m_orders(0),
+    m_vars(0),
     m_fp(m_stack + STACK_MAX),
     m_sp(m_stack + STACK_MAX),
     m_tos(0),
@@ -76,18 +125,62 @@ public:
     m_trace(false),
     m_cycle(0),
     m_base(10),
+    m_strs(0),
+    m_ap(0),
+    m_runs(0),
+    m_threshold(ARENA_MAX > 0 ? HOT_THRESHOLD : 0),
+    m_promotions(0),
+    m_catch(NULL),
+    m_error(NULL),
+    m_step(NULL),
+    m_thread(NULL),
+    m_top(NULL),
+    m_ticks(0),
+    m_rounds(0),
+    m_time_limit(0),
+    m_op_limit(0),
+    m_start(0),
+    m_seed(0),
+    m_device_regs(0),
+    m_device(0),
+    m_device_size(0),
     m_ios(ios)
   {
+    memset(m_calls, 0, sizeof(m_calls));
+    memset(m_count, 0, sizeof(m_count));
+    seed((uint16_t) (uintptr_t) this);
+
     // Restore state from eeprom
-    uint8_t entries = eeprom_read_byte((const uint8_t*) sizeof(char*));
+    if (!(FEATURES & SHELL_DICTIONARY)) return;
+    uint16_t entries = eeprom_read_word((const uint16_t*) sizeof(char*));
     char* dp = (char*) eeprom_read_word(0);
+    uint16_t magic = eeprom_read_word((const uint16_t*) MAGIC_ADDR);
+
+    // Initiate header when not valid for this dictionary size
+    if (magic != MAGIC || dp == (char*) 0xffff || entries > DICT_MAX) {
+      eeprom_update_block(&m_dp, 0, sizeof(m_dp));
+      eeprom_update_word((uint16_t*) sizeof(m_dp), m_entries);
+      eeprom_update_word((uint16_t*) (sizeof(m_dp) + sizeof(m_entries)), m_root);
+      eeprom_update_word((uint16_t*) MAGIC_ADDR, MAGIC);
+    }
 
-    // Check valid state before restore
-    if (dp != (char*) 0xffff && entries < VAR_MAX) {
+    // Restore state; only variables use memory
+    else {
       m_entries = entries;
       m_dp = dp;
-      for (uint8_t i = 0; i < entries; i++)
-	m_var[i] = eeprom_read_word((uint16_t*) &m_dict[i].value);
+      m_root = eeprom_read_word((const uint16_t*) (sizeof(char*) + sizeof(uint16_t)));
+      for (uint16_t i = 0; i < entries; i++) {
+	uint8_t cell = eeprom_read_byte(&m_dict[i].cell);
+	if (cell >= VAR_MAX) continue;
+	const uint16_t* vp = (const uint16_t*) &m_dict[i].value;
+	uint16_t n = 1;
+	if (eeprom_read_byte(&m_dict[i].attr) & ARRAY) {
+	  vp = (const uint16_t*) eeprom_read_word(vp);
+	  n = eeprom_read_word(vp++);
+	}
+	for (; n > 0 && cell < VAR_MAX; n--) m_var[cell++] = eeprom_read_word(vp++);
+	if (cell > m_vars) m_vars = cell;
+      }
     }
   }
 
@@ -219,6 +312,14 @@ public:
   int read(int addr) const
   {
     if (addr >= 0 && addr < (VAR_MAX + STACK_MAX)) return (m_var[addr]);
+    if (addr >= 0x2000 && addr < 0x4000) {
+      addr -= 0x2000;
+      if (addr >= m_entries) return (0);
+      uint8_t cell = eeprom_read_byte(&m_dict[addr].cell);
+      if (cell < VAR_MAX) return (m_var[cell]);
+      if (cell == VOCABULARY) return (0);
+      return (eeprom_read_word((const uint16_t*) &m_dict[addr].value));
+    }
     return (-pgm_read_word(&m_scripts[addr - 0x4000].code));
   }
 
@@ -229,6 +330,8 @@ public:
    */
   void write(int addr, int value)
   {
+    if (addr >= 0x2000 && addr < 0x2000 + m_entries)
+      addr = variable(addr - 0x2000);
     if (addr < 0 || addr >= (VAR_MAX + STACK_MAX)) return;
     m_var[addr] = value;
   }
@@ -255,19 +358,30 @@ public:
     strcpy_P(name, (const char*) var);
     int i = lookup(name, strlen(name), true);
     if (i < 0) return (i);
-    m_var[i] = value;
+    int cell = variable(i);
+    if (cell < 0) return (cell);
+    m_var[cell] = value;
     return (i);
   }
 
   /**
    * Define a function with given name and script in data memory.
+   * The script address is kept in the dictionary (in eeprom). The
+   * script is not copied and functions that have inlined the entry
+   * are not updated; nothing is written to eeprom when an application
+   * defines the same functions on every start.
    * @param[in] var name string.
    * @param[in] script string in data memory.
    * @return index or negative error code.
    */
   int set(const __FlashStringHelper* var, const char* script)
   {
-    return (set(var, (int) script));
+    char name[NAME_MAX];
+    strcpy_P(name, (const char*) var);
+    int i = lookup(name, strlen(name), true);
+    if (i < 0) return (i);
+    define(i, script);
+    return (i);
   }
 
   /**
@@ -278,7 +392,94 @@ public:
    */
   int set(const __FlashStringHelper* var, const __FlashStringHelper* script)
   {
-    return (set(var, (int) m_progmem.as_addr((const char*) script)));
+    return (set(var, m_progmem.as_addr((const char*) script)));
+  }
+
+  /**
+   * Define a variable with the address of given table in program
+   * memory (linear address), e.g. filter coefficients. Table elements
+   * are 16-bit, as cells on AVR.
+   * @param[in] var name string.
+   * @param[in] table in program memory.
+   * @return index or negative error code.
+   */
+  int set(const __FlashStringHelper* var, const int16_t* table)
+  {
+    return (set(var, (int) m_progmem.as_addr((const char*) table)));
+  }
+
+  /**
+   * Initiate queue in given cell array (variable address) with given
+   * capacity (max QUEUE_MAX elements). The cell array should have
+   * QUEUE_HEADER plus capacity elements. Should be called before the
+   * producer is started. Returns false if the cell array is out of
+   * bounds or the capacity is out of range.
+   * @param[in] addr cell array.
+   * @param[in] n capacity.
+   * @return bool.
+   */
+  bool queue(int addr, int n)
+  {
+    volatile int* qp = array(addr, QUEUE_HEADER + n);
+    if (qp == NULL || n < 1 || n > QUEUE_MAX) return (false);
+    qp[QUEUE_PUT] = 0;
+    qp[QUEUE_GET] = 0;
+    qp[QUEUE_OVERFLOW] = 0;
+    qp[QUEUE_SIZE] = n;
+    return (true);
+  }
+
+  /**
+   * Put element to given queue. Non-blocking; the overflow counter is
+   * incremented if the queue is full. Single producer, single
+   * consumer; may be called from an interrupt handler or another
+   * thread while a script consumes. Returns false if the queue is full
+   * or not valid.
+   * @param[in] addr queue cell array.
+   * @param[in] value element.
+   * @return bool.
+   */
+  bool enqueue(int addr, int value)
+  {
+    volatile int* qp = as_queue(addr);
+    if (qp == NULL) return (false);
+    int n = qp[QUEUE_SIZE];
+    int put = qp[QUEUE_PUT];
+    int get = qp[QUEUE_GET];
+    int count = put - get;
+    if (count < 0) count += 2 * n;
+    if (count == n) {
+      qp[QUEUE_OVERFLOW] += 1;
+      return (false);
+    }
+    qp[QUEUE_HEADER + (put < n ? put : put - n)] = value;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    qp[QUEUE_PUT] = (put + 1 < 2 * n ? put + 1 : 0);
+    return (true);
+  }
+
+  /**
+   * Get (or peek) element from given queue. Non-blocking; consumer
+   * side of enqueue(). Returns false if the queue is empty or not
+   * valid.
+   * @param[in] addr queue cell array.
+   * @param[out] value element.
+   * @param[in] peek leave element in queue (default false).
+   * @return bool.
+   */
+  bool dequeue(int addr, int& value, bool peek = false)
+  {
+    volatile int* qp = as_queue(addr);
+    if (qp == NULL) return (false);
+    int n = qp[QUEUE_SIZE];
+    int get = qp[QUEUE_GET];
+    if (qp[QUEUE_PUT] == get) return (false);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    value = qp[QUEUE_HEADER + (get < n ? get : get - n)];
+    if (peek) return (true);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    qp[QUEUE_GET] = (get + 1 < 2 * n ? get + 1 : 0);
+    return (true);
   }
 
   /**
@@ -288,13 +489,14 @@ public:
   {
     const char* np;
     char c;
-    uint8_t i = 0;
+    uint16_t i = 0;
 
     // List scripts in eeprom dicionary (dynamic)
     m_ios.print(m_eeprom.prefix());
     m_ios.print(F(": "));
     for (; i < m_entries; i++) {
       np = (const char*) eeprom_read_word((const uint16_t*) &m_dict[i].name);
+      if (eeprom_read_byte((const uint8_t*) np) == 0) continue;
       while ((c = (char) eeprom_read_byte((const uint8_t*) np++)) != 0)
 	m_ios.print(c);
       m_ios.print(' ');
@@ -313,6 +515,301 @@ public:
     m_ios.println();
   }
 
+  /** Idle time when there is no deadline (waiting for input). */
+  static const unsigned long NO_DEADLINE = 0xffffffffUL;
+
+  /**
+   * Idle hook; called by delay and key operations while waiting, and
+   * may be called by an application scheduler when no task is
+   * runnable. The default policy yields and then enters AVR idle
+   * sleep, whatever the deadline; it is the only sleep mode that keeps
+   * the millis timer and serial input running. The timer interrupt
+   * wakes the processor within a milli-second. Override to select
+   * deeper sleep modes from the deadline when the application has
+   * other wakeup sources (watchdog, pin change, RTC).
+   * @param[in] ms time to next deadline in milli-seconds (NO_DEADLINE
+   * when waiting for input only).
+   */
+  virtual void idle(unsigned long ms)
+  {
+    (void) ms;
+    yield();
+#if defined(ARDUINO_ARCH_AVR)
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_mode();
+#endif
+  }
+
+  /**
+   * Seed random number generator. The default seed is derived from
+   * the instance address so that each shell instance has a different,
+   * but reproducible, sequence.
+   * @param[in] value seed.
+   */
+  void seed(uint16_t value)
+  {
+    m_seed = 0x9e3779b9UL * (value + 1UL);
+  }
+
+  /**
+   * Return next random number (xorshift32, high 16 bits).
+   * @return random number.
+   */
+  uint16_t prng()
+  {
+    m_seed ^= m_seed << 13;
+    m_seed ^= m_seed >> 17;
+    m_seed ^= m_seed << 5;
+    return (m_seed >> 16);
+  }
+
+  /**
+   * Free-running cycle counter; used by the cycle counter operation
+   * (low bits). The default implementation uses the time stamp
+   * counter on x86 hosts, and on AVR micros() scaled to processor
+   * cycles (timer 0, 64 cycle resolution), as the other timers are
+   * used for PWM. Override to use a dedicated hardware timer.
+   * @return cycles.
+   */
+  virtual unsigned long cycles()
+  {
+#if defined(__i386__) || defined(__x86_64__)
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+    return (lo);
+#elif defined(F_CPU)
+    return (micros() * (F_CPU / 1000000L));
+#else
+    return (micros());
+#endif
+  }
+
+  /**
+   * SPI transfer of given buffer (full-duplex, in-place). Uses the
+   * Arduino SPI library with default settings when SPI.h is included
+   * before Shell.h (SPI.begin() is called by the sketch), otherwise
+   * the data is looped back (host stand-in). Override for other
+   * settings or fake devices.
+   * @param[in,out] buf buffer.
+   * @param[in] n number of bytes (max BUS_CHUNK).
+   * @return bool.
+   */
+  virtual bool spi(uint8_t* buf, size_t n)
+  {
+#if defined(_SPI_H_INCLUDED)
+    SPI.beginTransaction(SPISettings());
+    SPI.transfer(buf, n);
+    SPI.endTransaction();
+#else
+    (void) buf;
+    (void) n;
+#endif
+    return (true);
+  }
+
+  /**
+   * I2C register block read or write with register address
+   * auto-increment. Uses the Arduino Wire library when Wire.h is
+   * included before Shell.h (Wire.begin() is called by the sketch),
+   * otherwise the device attached with device() (host stand-in).
+   * Override for other fake devices. Returns false if the device did
+   * not acknowledge.
+   * @param[in] dev device address.
+   * @param[in] reg register address.
+   * @param[in,out] buf buffer.
+   * @param[in] n number of bytes (max BUS_CHUNK).
+   * @param[in] read register read (true) or write (false).
+   * @return bool.
+   */
+  virtual bool i2c(uint8_t dev, uint8_t reg, uint8_t* buf, size_t n, bool read)
+  {
+#if defined(TwoWire_h) || defined(TWOWIRE_H)
+    Wire.beginTransmission(dev);
+    Wire.write(reg);
+    if (!read) Wire.write(buf, n);
+    if (Wire.endTransmission(!read) != 0) return (false);
+    if (!read) return (true);
+    if (Wire.requestFrom(dev, (uint8_t) n) != n) return (false);
+    for (size_t i = 0; i < n; i++) buf[i] = Wire.read();
+    return (true);
+#else
+    int* regs = array(m_device_regs, m_device_size);
+    if (dev != m_device || regs == NULL || reg + n > m_device_size)
+      return (false);
+    for (size_t i = 0; i < n; i++) {
+      if (read)
+	buf[i] = regs[reg + i];
+      else
+	regs[reg + i] = buf[i];
+    }
+    return (true);
+#endif
+  }
+
+  /**
+   * Attach fake I2C device with registers in given cell array
+   * (variable address). Used by the default i2c() when the Wire
+   * library is not included; scripts may preset and check the
+   * registers as variables.
+   * @param[in] dev device address.
+   * @param[in] addr cell array.
+   * @param[in] n number of registers.
+   */
+  void device(uint8_t dev, int addr, uint8_t n)
+  {
+    m_device = dev;
+    m_device_regs = addr;
+    m_device_size = n;
+  }
+
+  /**
+   * Debounce tick; sample the pins of given debouncer (variable
+   * address, initiated with the debounce operation) and integrate
+   * with two bit vertical counters. An input changes state after four
+   * consecutive ticks with the same new level. The changes are also
+   * accumulated in the events cell. Call periodically, e.g. every 5
+   * ms, from the same context as the scripts that read the events.
+   * Returns changed inputs (bit mask) or zero if not valid.
+   * @param[in] addr debouncer cell array.
+   * @return changed inputs.
+   */
+  int debounce(int addr)
+  {
+    int* dp = as_debounce(addr);
+    if (dp == NULL) return (0);
+    unsigned delta = sample(dp) ^ dp[DEBOUNCE_STATE];
+    unsigned cnt0 = dp[DEBOUNCE_CNT0];
+    unsigned cnt1 = (dp[DEBOUNCE_CNT1] ^ cnt0) & delta;
+    cnt0 = ~cnt0 & delta;
+    unsigned changed = delta & ~(cnt0 | cnt1);
+    dp[DEBOUNCE_CNT0] = cnt0;
+    dp[DEBOUNCE_CNT1] = cnt1;
+    dp[DEBOUNCE_STATE] ^= changed;
+    dp[DEBOUNCE_EVENTS] |= changed;
+    return (changed);
+  }
+
+  /**
+   * Initiate stepper axis in given cell array (variable address) with
+   * step and direction pins, and tick rate of the timer that calls
+   * motion(). The tick of each step (since start of move) is put to
+   * the given queue, if not negative, to record the step timeline.
+   * Moves start and end at the min velocity (steps per second); when
+   * zero the deceleration ends at one acceleration step per tick.
+   * Should be called before the timer is started. Returns false if
+   * the cell array is out of bounds or the rate is zero.
+   * @param[in] addr axis cell array (AXIS_CELLS elements).
+   * @param[in] step pin.
+   * @param[in] dir direction pin.
+   * @param[in] rate tick rate (Hz).
+   * @param[in] log step timeline queue or negative (default none).
+   * @param[in] vmin min velocity (default zero).
+   * @return bool.
+   */
+  bool axis(int addr, uint8_t step, uint8_t dir, uint16_t rate, int log = -1,
+	    uint16_t vmin = 0)
+  {
+    axis_t* ap = (axis_t*) array(addr, AXIS_CELLS);
+    if (ap == NULL || rate == 0) return (false);
+    memset(ap, 0, sizeof(axis_t));
+    uint32_t v = ratio(vmin, rate);
+    ap->vmin = (v >= 0x8000UL) ? 0x80000000UL : (v << 16);
+    ap->rate = rate;
+    ap->log = log;
+    ap->step = step;
+    ap->dir = dir;
+    ap->sign = 1;
+    pinMode(step, OUTPUT);
+    pinMode(dir, OUTPUT);
+    digitalWrite(step, LOW);
+    return (true);
+  }
+
+  /**
+   * Start move of given stepper axis; relative number of steps, max
+   * velocity (steps per second) and acceleration (steps per second
+   * squared). Trapezoidal profile from and to the min velocity of the
+   * axis; the deceleration uses the number of steps of the
+   * acceleration. The velocity is limited to half the tick rate. Returns false if the axis is moving or not valid.
+   * @param[in] addr axis cell array.
+   * @param[in] steps relative position.
+   * @param[in] vmax max velocity.
+   * @param[in] accel acceleration.
+   * @return bool.
+   */
+  bool move(int addr, int steps, uint16_t vmax, uint16_t accel)
+  {
+    volatile axis_t* ap = as_axis(addr);
+    if (ap == NULL || ap->state != AXIS_IDLE || vmax == 0 || accel == 0)
+      return (false);
+    if (steps == 0) return (true);
+    ap->sign = (steps < 0) ? -1 : 1;
+    digitalWrite(ap->dir, (steps < 0) ? LOW : HIGH);
+    uint32_t v = ratio(vmax, ap->rate);
+    ap->vmax = (v >= 0x8000UL) ? 0x80000000UL : (v << 16);
+    ap->accel = ratio(ratio(accel, ap->rate), ap->rate);
+    if (ap->accel == 0) ap->accel = 1;
+    ap->velocity = (ap->vmin < ap->vmax) ? ap->vmin : ap->vmax;
+    ap->phase = 0;
+    ap->ramp = 0;
+    ap->ticks = 0;
+    ap->remaining = (steps < 0) ? -steps : steps;
+    ap->state = AXIS_ACCEL;
+    return (true);
+  }
+
+  /**
+   * Stepper motion tick; call from a timer interrupt handler at the
+   * axis tick rate. Ends the step pulse of the previous tick, updates
+   * the velocity and generates a step pulse when the phase accumulator
+   * overflows (one step per two ticks max). Returns the motion state.
+   * @param[in] addr axis cell array.
+   * @return state.
+   */
+  uint8_t motion(int addr)
+  {
+    volatile axis_t* ap = as_axis(addr);
+    if (ap == NULL) return (AXIS_IDLE);
+    if (ap->level) {
+      digitalWrite(ap->step, LOW);
+      ap->level = 0;
+    }
+    if (ap->state == AXIS_IDLE) return (AXIS_IDLE);
+    ap->ticks += 1;
+    if (ap->state == AXIS_ACCEL) {
+      ap->velocity += ap->accel;
+      if (ap->velocity >= ap->vmax) {
+	ap->velocity = ap->vmax;
+	ap->state = AXIS_CRUISE;
+      }
+    }
+    else if (ap->state == AXIS_DECEL) {
+      uint32_t vmin = (ap->vmin != 0) ? ap->vmin : ap->accel;
+      if (vmin > ap->vmax) vmin = ap->vmax;
+      if (ap->velocity > vmin + ap->accel)
+	ap->velocity -= ap->accel;
+      else
+	ap->velocity = vmin;
+    }
+    uint32_t phase = ap->phase + ap->velocity;
+    bool carry = (phase < ap->phase);
+    ap->phase = phase;
+    if (!carry) return (ap->state);
+    digitalWrite(ap->step, HIGH);
+    ap->level = 1;
+    ap->position += ap->sign;
+    if (ap->log >= 0) enqueue(ap->log, ap->ticks);
+    ap->remaining -= 1;
+    if (ap->state == AXIS_ACCEL) ap->ramp += 1;
+    if (ap->remaining == 0) {
+      ap->velocity = 0;
+      ap->state = AXIS_IDLE;
+    }
+    else if (ap->state != AXIS_DECEL && ap->remaining <= ap->ramp)
+      ap->state = AXIS_DECEL;
+    return (ap->state);
+  }
+
   /**
    * Non-blocking read next character from shell stream. If available
    * add to buffer. If newline was read the buffer is null-terminated
@@ -334,11 +831,74 @@ public:
   /**
    * Execute given script (null terminated sequence of operation
    * codes). Return NULL if successful otherwise script reference that
-   * failed. Prints error position in trace mode.
+   * failed (linear address of the failed operation or uncaught throw).
+   * Prints error position in trace mode. Errors and exceptions in
+   * nested calls unwind directly to the handler (catch or top level).
    * @param[in] script.
    * @return script reference or NULL.
    */
   const char* execute(const char* script)
+  {
+    // Nested execute; errors and exceptions unwind to the handler
+    if (m_catch != NULL) {
+      interpret(script);
+      return (NULL);
+    }
+
+    // Top level; handle errors, uncaught exceptions and abort
+    jmp_buf env;
+    int* fp = m_fp;
+    int* sp = m_sp;
+    int tos = m_tos;
+    m_error = NULL;
+    m_ticks = 0;
+    m_rounds = 0;
+    m_start = millis();
+    int res = setjmp(env);
+    if (res == 0) {
+      m_catch = m_top = &env;
+      interpret(script);
+    }
+    else {
+      m_fp = fp;
+      m_marker = -1;
+      m_runs = 0;
+      m_step = NULL;
+      if (res == ABORT_CODE) {
+	m_sp = sp;
+	m_tos = tos;
+	Memory* mem = access(m_error);
+	m_ios.print(F("abort:"));
+	m_ios.print(mem->prefix());
+	m_ios.print('/');
+	m_ios.println((int) mem->as_local(m_error));
+      }
+    }
+    m_catch = m_top = NULL;
+    return (m_error);
+  }
+
+  /**
+   * Set execution limits for each command (top level execute). The
+   * limits are checked every 256 operations. The command is aborted,
+   * the parameter stack and frame pointer restored and the position
+   * printed when a limit is exceeded.
+   * @param[in] ms time limit in milli-seconds (zero for none).
+   * @param[in] ops operation limit in 256 operations (zero for none).
+   */
+  void limit(uint16_t ms, uint16_t ops)
+  {
+    m_time_limit = ms;
+    m_op_limit = ops;
+  }
+
+protected:
+  /**
+   * Interpret given script (null terminated sequence of operation
+   * codes). Errors unwind to the current handler; see execute().
+   * @param[in] script.
+   */
+  void interpret(const char* script)
   {
     Memory* mem = access(script);
     next_fn next = mem->get_next_fn();
@@ -351,9 +911,23 @@ public:
     const char* sp;
     char op;
 
+    // Run threaded code when available (not in trace mode)
+    if (ARENA_MAX > 0 && !m_trace && mem != &m_memory) {
+      const int* code = threaded(script);
+      if (code != NULL) {
+	m_runs += 1;
+	if (!run(script, code)) raise(script, -1);
+	m_runs -= 1;
+	return;
+      }
+    }
+
     // Execute operation code in script
     while ((op = next(ip++)) != 0) {
 
+      // Check execution limits (amortized)
+      if (++m_ticks == 0) tick(mem->as_addr(ip - 1));
+
       // Check for negative numbers
       if (op == '-') {
 	op = next(ip);
@@ -499,6 +1073,54 @@ public:
 	w = pop();
 	tos(tos() ^ w);
 	continue;
+      case 'B':
+	switch (op = next(ip++)) {
+	case 'l': // x n -- x<<n | shift left
+	  n = pop();
+	  tos((n < 0 || n >= CELL_BITS) ? 0 : (int) ((unsigned) tos() << n));
+	  continue;
+	case 'r': // x n -- x>>n | logical shift right
+	  n = pop();
+	  tos((n < 0 || n >= CELL_BITS) ? 0 : (int) ((unsigned) tos() >> n));
+	  continue;
+	case 'a': // x n -- x>>n | arithmetic shift right
+	  n = pop();
+	  if (n < 0) n = 0;
+	  else if (n >= CELL_BITS) n = CELL_BITS - 1;
+	  tos(tos() >> n);
+	  continue;
+	case 'o': // x n -- y | rotate left (n > 0) or right (n < 0)
+	  n = pop() & (CELL_BITS - 1);
+	  if (n != 0)
+	    tos((int) (((unsigned) tos() << n) | ((unsigned) tos() >> (CELL_BITS - n))));
+	  continue;
+	case 'c': // x -- n | population count
+	  tos(__builtin_popcount((unsigned) tos()));
+	  continue;
+	case 'z': // x -- n | count leading zeros
+	  tos(tos() == 0 ? CELL_BITS : __builtin_clz((unsigned) tos()));
+	  continue;
+	case 'x': // x pos width -- field | bit-field extract
+	  w = pop();
+	  n = pop();
+	  if (n < 0 || n >= CELL_BITS || w <= 0) tos(0);
+	  else {
+	    tos((unsigned) tos() >> n);
+	    if (w < CELL_BITS) tos(tos() & ((1U << w) - 1));
+	  }
+	  continue;
+	case 'i': // x y pos width -- z | bit-field insert
+	  w = pop();
+	  n = pop();
+	  addr = pop();
+	  if (n >= 0 && n < CELL_BITS && w > 0) {
+	    unsigned mask = (w < CELL_BITS) ? ((1U << w) - 1) : ~0U;
+	    mask = mask << n;
+	    tos((int) (((unsigned) tos() & ~mask) | (((unsigned) addr << n) & mask)));
+	  }
+	  continue;
+	}
+	goto error;
       /*
        * Stack operations.
        */
@@ -557,11 +1179,11 @@ public:
 	write(addr, w);
 	continue;
       case 'z': // addr -- | write variable to eeprom
-	w = pop();
-	if (w >= 0 && w < m_entries)
-	  eeprom_write_word((uint16_t*) &m_dict[w].value, (uint16_t) m_var[w]);
+	if (!(FEATURES & SHELL_DICTIONARY)) goto error;
+	save(pop());
 	continue;
       case 'a': // -- bytes entries | allocated eeprom
+	if (!(FEATURES & SHELL_DICTIONARY)) goto error;
 	push((int) m_dp);
 	push(m_entries);
 	continue;
@@ -569,6 +1191,7 @@ public:
        * Stack frame operations.
        */
       case '\\':
+	if (!(FEATURES & SHELL_FRAMES)) goto error;
 	n = pop();
 	// x1..xn n -- x1..xn | mark n-element stack frame
 	if (n > 0) {
@@ -588,6 +1211,7 @@ public:
 	}
 	continue;
       case '$': // n -- addr | address of n-element in frame
+	if (!(FEATURES & SHELL_FRAMES)) goto error;
 	n = tos();
 	tos((m_fp - n) - m_var);
 	continue;
@@ -595,15 +1219,18 @@ public:
        * Input/output operations.
        */
       case 'k': // -- char | blocking read from input stream
-	while ((w = m_ios.read()) < 0) yield();
+	while ((w = m_ios.read()) < 0) idle(NO_DEADLINE);
 	push(w);
 	continue;
       case 'b': // base -- | number print base
+	if (!(FEATURES & SHELL_OUTPUT)) goto error;
 	m_base = pop();
 	continue;
       case '?': // addr -- | print variable
+	if (!(FEATURES & SHELL_OUTPUT)) goto error;
 	tos(read(tos()));
       case '.': // x -- | print number followed by one space
+	if (!(FEATURES & SHELL_OUTPUT)) goto error;
 	w = pop();
 	if (m_base == 2) m_ios.print(F("0b"));
 	else if (m_base == 8) m_ios.print(F("0"));
@@ -612,11 +1239,13 @@ public:
 	m_ios.print(' ');
 	continue;
       case 'm': // -- | write new line to output stream
+	if (!(FEATURES & SHELL_OUTPUT)) goto error;
 	m_ios.println();
 	continue;
       case 't': // addr -- | write variable name output stream
-	addr = tos();
-	if (addr >= 0 && addr < m_entries) {
+	if (!(FEATURES & SHELL_DICTIONARY)) goto error;
+	addr = entry(tos());
+	if (addr >= 0) {
 	  const uint8_t* np =
 	    (const uint8_t*) eeprom_read_word((const uint16_t*) &m_dict[addr].name);
 	  char c;
@@ -628,9 +1257,388 @@ public:
 	else tos(0);
 	continue;
       case 'v': // char -- | write character to output stream
+	if (!(FEATURES & SHELL_OUTPUT)) goto error;
 	w = pop();
 	m_ios.write(w);
 	continue;
+      /*
+       * String operations.
+       */
+      case 'G':
+	switch (op = next(ip++)) {
+	case 'c': // addr1 len1 addr2 len2 -- cmp | compare strings
+	  n = pop();
+	  sp = (const char*) pop();
+	  w = pop();
+	  tos(compare((const char*) tos(), w, sp, n));
+	  continue;
+	case 'l': // addr -- addr len | length of null terminated string
+	  sp = (const char*) tos();
+	  {
+	    Memory* mp = access(sp);
+	    next_fn np = mp->get_next_fn();
+	    const char* p = mp->as_local(sp);
+	    for (n = 0; np(p++) != 0; n++);
+	  }
+	  push(n);
+	  continue;
+	case 'n': // addr len -- [n true] or false | parse number
+	  n = pop();
+	  sp = (const char*) tos();
+	  if (parse(sp, n, w)) {
+	    tos(w);
+	    push(-1);
+	  }
+	  else tos(0);
+	  continue;
+	case 'f': // x1..xn addr len -- | formatted output
+	  if (!(FEATURES & SHELL_OUTPUT)) goto error;
+	  n = pop();
+	  sp = (const char*) pop();
+	  if (!format(sp, n)) goto error;
+	  continue;
+	case 't': // addr len -- | write string to output stream
+	  if (!(FEATURES & SHELL_OUTPUT)) goto error;
+	  n = pop();
+	  sp = (const char*) pop();
+	  type(sp, n);
+	  continue;
+	}
+	goto error;
+      /*
+       * System operations.
+       */
+      case 'J':
+	switch (op = next(ip++)) {
+	case 'v': // addr -- | define vocabulary
+	  if (!(FEATURES & SHELL_DICTIONARY)) goto error;
+	  n = entry(pop());
+	  if (n < 0 || n >= m_entries) goto error;
+	  define(n, (const char*) NO_ENTRY);
+	  eeprom_update_byte(&m_dict[n].cell, VOCABULARY);
+	  continue;
+	case 'o': // addr -- | add vocabulary first in search order
+	  if (!(FEATURES & SHELL_DICTIONARY)) goto error;
+	  n = entry(pop());
+	  if (n < 0 || eeprom_read_byte(&m_dict[n].cell) != VOCABULARY) goto error;
+	  if (m_orders == ORDER_MAX) goto error;
+	  for (w = m_orders; w > 0; w--) m_order[w] = m_order[w - 1];
+	  m_order[0] = n;
+	  m_orders += 1;
+	  unthread();
+	  continue;
+	case 'p': // -- | remove first vocabulary in search order
+	  if (!(FEATURES & SHELL_DICTIONARY)) goto error;
+	  if (m_orders == 0) goto error;
+	  m_orders -= 1;
+	  for (w = 0; w < m_orders; w++) m_order[w] = m_order[w + 1];
+	  unthread();
+	  continue;
+	case 'r': // -- | reset search order to root
+	  if (!(FEATURES & SHELL_DICTIONARY)) goto error;
+	  m_orders = 0;
+	  unthread();
+	  continue;
+	case 'c': // block -- code | catch exception in block (zero if none)
+	  sp = (const char*) pop();
+	  push(protect(sp));
+	  continue;
+	case 'e': // code -- | throw exception if code is not zero
+	  w = pop();
+	  if (w != 0) raise((script == m_step) ? m_thread : mem->as_addr(ip - 2), w);
+	  continue;
+	case 'd': // -- | set definitions to first vocabulary in search order
+	  if (!(FEATURES & SHELL_DICTIONARY)) goto error;
+	  m_current = (m_orders > 0) ? m_order[0] : NO_ENTRY;
+	  continue;
+	case 't': // addr -- bool | translate function to threaded code
+	  tos(as_bool(thread((const char*) read(tos()))));
+	  continue;
+	case 'u': // addr -- | remove threaded code of function
+	  unthread((const char*) read(pop()));
+	  continue;
+	case 'a': // -- used size | threaded code arena usage (cells)
+	  push(m_ap);
+	  push(ARENA_MAX);
+	  continue;
+	case 'i': // addr -- | inline function or variable (constant)
+	  if (!(FEATURES & SHELL_DICTIONARY)) goto error;
+	  n = entry(pop());
+	  if (n < 0) goto error;
+	  eeprom_update_byte(&m_dict[n].attr, eeprom_read_byte(&m_dict[n].attr) | INLINE);
+	  depends(n, 0);
+	  continue;
+	case 'm': // -- us | micros()
+	  push(micros());
+	  continue;
+	case 'n': // -- cycles | cycle counter
+	  push(cycles());
+	  continue;
+	case 'b': // addr -- | mark time (micros) in variable
+	  write(pop(), micros());
+	  continue;
+	case 'f': // addr -- us | micros since mark in variable
+	  tos((unsigned) micros() - (unsigned) read(tos()));
+	  continue;
+	case 'l': // ms n -- | set command time and operation (n*256) limits
+	  n = pop();
+	  limit(pop(), n);
+	  continue;
+	case 'h': // calls -- | set promotion threshold (0 to disable)
+	  w = pop();
+	  m_threshold = (w < 0 || w >= NOT_HOT) ? NOT_HOT - 1 : w;
+	  continue;
+	case 's': // -- promotions text threaded native | tier statistics
+	  push(m_promotions);
+	  push(m_calls[TIER_TEXT]);
+	  push(m_calls[TIER_THREADED]);
+	  push(m_calls[TIER_NATIVE]);
+	  memset(m_calls, 0, sizeof(m_calls));
+	  continue;
+	case 'S': // addr n cs -- | spi transfer (in-place, chip select pin)
+	  if (!(FEATURES & SHELL_PINS)) goto error;
+	  pin = pop();
+	  n = pop();
+	  if (!transfer(op, pop(), n, pin, 0)) goto error;
+	  continue;
+	case 'R': // addr n dev reg -- bool | i2c register block read
+	case 'W': // addr n dev reg -- bool | i2c register block write
+	  if (!(FEATURES & SHELL_PINS)) goto error;
+	  {
+	    int reg = pop();
+	    int dev = pop();
+	    n = pop();
+	    if (array(tos(), n) == NULL) goto error;
+	    tos(transfer(op, tos(), n, dev, reg) ? -1 : 0);
+	  }
+	  continue;
+	case 'O': // value data clock -- | shift out (msb first)
+	  if (!(FEATURES & SHELL_PINS)) goto error;
+	  pin = pop();
+	  w = pop();
+	  shiftOut(w, pin, MSBFIRST, pop());
+	  continue;
+	case 'I': // data clock -- value | shift in (msb first)
+	  if (!(FEATURES & SHELL_PINS)) goto error;
+	  pin = pop();
+	  tos(shiftIn(tos(), pin, MSBFIRST));
+	  continue;
+	case 'K': // pin1..pinn n addr -- | initiate debounce of pins
+	  if (!(FEATURES & SHELL_PINS)) goto error;
+	  {
+	    addr = pop();
+	    n = pop();
+	    int* dp = array(addr, DEBOUNCE_HEADER + n);
+	    if (dp == NULL || n < 1 || n > CELL_BITS || n > depth()) goto error;
+	    for (w = n - 1; w >= 0; w--) dp[DEBOUNCE_HEADER + w] = pop();
+	    dp[DEBOUNCE_PINS] = n;
+	    dp[DEBOUNCE_STATE] = sample(dp);
+	    dp[DEBOUNCE_CNT0] = 0;
+	    dp[DEBOUNCE_CNT1] = 0;
+	    dp[DEBOUNCE_EVENTS] = 0;
+	  }
+	  continue;
+	case 'T': // addr -- changed | debounce tick; sample pins
+	  if (!(FEATURES & SHELL_PINS)) goto error;
+	  if (as_debounce(tos()) == NULL) goto error;
+	  tos(debounce(tos()));
+	  continue;
+	case 'X': // step dir rate log vmin addr -- | initiate stepper axis
+	  if (!(FEATURES & SHELL_PINS)) goto error;
+	  {
+	    addr = pop();
+	    uint16_t vmin = pop();
+	    int log = pop();
+	    uint16_t rate = pop();
+	    pin = pop();
+	    if (!axis(addr, pop(), pin, rate, log, vmin)) goto error;
+	  }
+	  continue;
+	case 'M': // steps vmax accel addr -- bool | start stepper move
+	  if (!(FEATURES & SHELL_PINS)) goto error;
+	  {
+	    addr = pop();
+	    if (as_axis(addr) == NULL) goto error;
+	    uint16_t accel = pop();
+	    uint16_t vmax = pop();
+	    tos(move(addr, tos(), vmax, accel) ? -1 : 0);
+	  }
+	  continue;
+	case 'P': // addr -- position state | stepper position and state
+	  if (!(FEATURES & SHELL_PINS)) goto error;
+	  {
+	    volatile axis_t* ap = as_axis(tos());
+	    if (ap == NULL) goto error;
+	    do w = ap->position; while (w != ap->position);
+	    tos(w);
+	    push(ap->state);
+	  }
+	  continue;
+	case 'E': // addr -- state events | debounced state and events (clear)
+	  if (!(FEATURES & SHELL_PINS)) goto error;
+	  {
+	    int* dp = as_debounce(tos());
+	    if (dp == NULL) goto error;
+	    tos(dp[DEBOUNCE_STATE]);
+	    push(dp[DEBOUNCE_EVENTS]);
+	    dp[DEBOUNCE_EVENTS] = 0;
+	  }
+	  continue;
+	}
+	goto error;
+      /*
+       * Vector operations.
+       */
+      case 'V':
+	switch (op = next(ip++)) {
+	case 'a': // addr n -- | allot variable with n-elements
+	  if (!(FEATURES & SHELL_DICTIONARY)) goto error;
+	  n = pop();
+	  addr = pop();
+	  if (!allot(addr, n)) goto error;
+	  continue;
+	case '8': // addr n crc -- crc | crc-8
+	case 'C': // addr n crc -- crc | crc-16/ccitt
+	case 'F': // addr n sum -- sum | fletcher-16
+	  {
+	    uint32_t crc = (uint16_t) pop();
+	    n = pop();
+	    if (!checksum(op, tos(), n, crc)) goto error;
+	    tos(crc);
+	  }
+	  continue;
+	case 's': // seed -- | seed random number generator
+	  seed(pop());
+	  continue;
+	case 'r': // -- x | random number
+	  push(prng());
+	  continue;
+	case 'n': // n -- x | random number in range 0..n-1
+	  tos(((uint32_t) prng() * (uint16_t) tos()) >> 16);
+	  continue;
+	case 'f': // addr n max -- | fill array with random numbers 0..max-1
+	  {
+	    uint16_t max = pop();
+	    n = pop();
+	    int* vp = array(pop(), n);
+	    if (vp == NULL) goto error;
+	    while (n--) *vp++ = max ? ((uint32_t) prng() * max) >> 16 : prng();
+	  }
+	  continue;
+	case 'o': // addr n -- | sort array (ascending)
+	  n = pop();
+	  if (!sort(pop(), n)) goto error;
+	  continue;
+	case 'h': // addr n k -- | move k largest to front (descending)
+	  w = pop();
+	  n = pop();
+	  if (!top(pop(), n, w)) goto error;
+	  continue;
+	case 'b': // addr n x -- index | binary search sorted array
+	  w = pop();
+	  n = pop();
+	  {
+	    int* xp = array(tos(), n);
+	    if (xp == NULL) goto error;
+	    unsigned lo = 0, hi = n;
+	    while (lo < hi) {
+	      unsigned mid = (lo + hi) >> 1;
+	      if (xp[mid] < w) lo = mid + 1; else hi = mid;
+	    }
+	    tos(lo);
+	  }
+	  continue;
+	case 'i': // dst src n min width m -- count | histogram
+	case 'u': // dst src n threshold max -- count | up-crossing indices
+	case 'd': // dst src n threshold max -- count | down-crossing indices
+	case 'p': // dst src n threshold max -- count | local peak indices
+	  {
+	    int m = pop();
+	    int width = (op == 'i' ? pop() : 0);
+	    int threshold = pop();
+	    n = pop();
+	    w = pop();
+	    if (op == 'i')
+	      n = histogram(tos(), w, n, threshold, width, m);
+	    else
+	      n = detect(op, tos(), w, n, threshold, m);
+	    if (n < 0) goto error;
+	    tos(n);
+	  }
+	  continue;
+	case 't': // re im n -- | fast fourier transform (in-place)
+	case 'm': // re im n -- | magnitude of complex array to re
+	  n = pop();
+	  w = pop();
+	  if (!(op == 't' ? fft(tos(), w, n) : magnitude(tos(), w, n))) goto error;
+	  pop();
+	  continue;
+	case 'k': // dst src n coef m shift -- count | fir filter (convolution)
+	case 'x': // dst src n coef m shift -- count | cross-correlation
+	  {
+	    uint8_t shift = pop();
+	    int m = pop();
+	    int coef = pop();
+	    n = pop();
+	    w = pop();
+	    n = fir(op == 'k', tos(), w, n, coef, m, shift);
+	    if (n < 0) goto error;
+	    tos(n);
+	  }
+	  continue;
+	case 'L': // addr n lsw msw -- lsw msw | crc-32
+	  {
+	    uint32_t crc = (uint16_t) pop();
+	    crc = (crc << 16) | (uint16_t) pop();
+	    n = pop();
+	    if (!checksum(op, tos(), n, crc)) goto error;
+	    tos(crc & 0xffff);
+	    push(crc >> 16);
+	  }
+	  continue;
+	}
+	goto error;
+      /*
+       * Queue operations.
+       */
+      case 'Q':
+	switch (op = next(ip++)) {
+	case 'i': // addr n -- | initiate queue with capacity n
+	  n = pop();
+	  if (!queue(pop(), n)) goto error;
+	  continue;
+	case 'p': // x addr -- bool | put element to queue
+	  addr = pop();
+	  if (as_queue(addr) == NULL) goto error;
+	  tos(enqueue(addr, tos()) ? -1 : 0);
+	  continue;
+	case 'g': // addr -- [x true] or false | get element from queue
+	case 'k': // addr -- [x true] or false | peek element in queue
+	  addr = tos();
+	  if (as_queue(addr) == NULL) goto error;
+	  if (dequeue(addr, w, op == 'k')) {
+	    tos(w);
+	    push(-1);
+	  }
+	  else tos(0);
+	  continue;
+	case 'n': // addr -- n | number of elements in queue
+	  {
+	    int* qp = as_queue(tos());
+	    if (qp == NULL) goto error;
+	    n = qp[QUEUE_PUT] - qp[QUEUE_GET];
+	    tos(n < 0 ? n + 2 * qp[QUEUE_SIZE] : n);
+	  }
+	  continue;
+	case 'o': // addr -- n | number of overflows
+	  {
+	    int* qp = as_queue(tos());
+	    if (qp == NULL) goto error;
+	    tos(qp[QUEUE_OVERFLOW]);
+	  }
+	  continue;
+	}
+	goto error;
       /*
        * Control structure operations.
        */
@@ -645,20 +1653,16 @@ public:
 	  drop();
 	}
 	drop();
-	if (execute(sp) != NULL) goto error;
+	interpret(sp);
 	continue;
       case 'f': // addr -- | forget variable
-	w = pop();
-	if (w >= 0 && w < m_entries) {
-	  m_entries = w;
-	  m_dp = (char*) eeprom_read_word((const uint16_t*) &m_dict[w].name);
-	  eeprom_update_block(&m_dp, 0, sizeof(m_dp));
-	  eeprom_update_byte((uint8_t*) sizeof(m_dp), m_entries);
-	}
+	if (!(FEATURES & SHELL_DICTIONARY)) goto error;
+	w = entry(pop());
+	if (w >= 0) forget(w);
 	continue;
       case 'i': // flag block -- | execute block if flag is true
 	sp = (const char*) pop();
-	if (pop() && execute(sp) != NULL) goto error;
+	if (pop()) interpret(sp);
 	continue;
       case 'l': // low high block( i -- ) -- | execute block from low to high
 	{
@@ -667,19 +1671,19 @@ public:
 	  int low = pop();
 	  for (int i = low; i <= high; i++) {
 	    push(i);
-	    if (execute(sp) != NULL) goto error;
+	    interpret(sp);
 	  }
 	}
 	continue;
       case 'w': // block( -- flag) -- | execute block while
 	sp = (const char*) pop();
 	do {
-	  if (execute(sp) != NULL) goto error;
+	  interpret(sp);
 	} while (pop());
 	continue;
       case 'x': // script -- | execute script
 	sp = (const char*) pop();
-	if (execute(sp) != NULL) goto error;
+	interpret(sp);
 	continue;
       case 'y': // -- | yield
 	yield();
@@ -714,37 +1718,17 @@ public:
 
 	  // Push address on colon and execute on quote
 	  if (flag) {
-	    if (i < VAR_MAX)
-	      push(i);
-	    else push((i - VAR_MAX) + 0x4000);
-	  }
-	  else if (i < VAR_MAX) {
-	    sp = (const char*) read(i);
-	    if (sp == NULL) goto error;
-	    if (execute(sp) != NULL) goto error;
-	  }
-	  else {
-	    i = i - VAR_MAX;
-	    sp = (const char*) pgm_read_word(&m_scripts[i].code);
-	    if (execute(m_progmem.as_addr(sp)) != NULL) goto error;
+	    if (i < DICT_MAX)
+	      push(address(i));
+	    else push((i - DICT_MAX) + 0x4000);
 	  }
+	  else if (!call(i)) goto error;
 	}
 	continue;
       case ';': // addr block -- | copy block to variable
-	{
-	  const char* dest = m_eeprom.as_addr(m_dp);
-	  const char* src = (const char*) pop();
-	  int addr = pop();
-	  if (addr >= 0 && addr < m_entries) {
-	    eeprom_update_block(src, m_dp, len);
-	    m_dp += len;
-	    eeprom_update_byte((uint8_t*) m_dp, 0);
-	    m_dp += 1;
-	    eeprom_update_block(&m_dp, 0, sizeof(m_dp));
-	    write(addr, dest);
-	    eeprom_write_word((uint16_t*) &m_dict[addr].value, (uint16_t) dest);
-	  }
-	}
+	if (!(FEATURES & SHELL_DICTIONARY)) goto error;
+	sp = (const char*) pop();
+	if (!copy(pop(), sp, len)) goto error;
 	continue;
       case '{': // -- block | start code block
 	left = '{';
@@ -752,8 +1736,9 @@ public:
 	push(mem->as_addr(ip));
 	break;
       case '}': // -- | end of block
-	return (NULL);
+	return;
       case '(': // -- | start output string
+	if (!(FEATURES & SHELL_OUTPUT)) goto error;
 	left = '(';
 	right = ')';
 	break;
@@ -764,11 +1749,18 @@ public:
 	}
 	break;
       case ']': // xn..x1 -- n | end stack marker
-	if (m_marker != -1) {
-	  push(depth() - m_marker);
-	  m_marker = -1;
-	  continue;
-	}
+	if (m_marker == -1) goto error;
+	push(depth() - m_marker);
+	m_marker = -1;
+	continue;
+      case '"': // -- addr len | push string literal
+	sp = mem->as_addr(ip);
+	n = literal(sp, mem != &m_memory);
+	if (n < 0) goto error;
+	ip += n + 1;
+	push(sp);
+	push(n);
+	continue;
       case '\'': // -- char | push character
 	op = next(ip);
 	if (op != 0) {
@@ -780,6 +1772,7 @@ public:
        * Arduino operations.
        */
       case 'A': // pin -- sample | analogRead(pin)
+	if (!(FEATURES & SHELL_ANALOG)) goto error;
 	pin = tos();
 	tos(analogRead(pin));
 	continue;
@@ -787,8 +1780,12 @@ public:
 	clear();
 	continue;
       case 'D': // ms -- | delay()
-	w = pop();
-	delay((unsigned) w);
+	{
+	  unsigned long start = millis();
+	  unsigned long ms = (unsigned) pop();
+	  unsigned long elapsed;
+	  while ((elapsed = millis() - start) < ms) idle(ms - elapsed);
+	}
 	continue;
       case 'E': // period addr -- bool | time-out
 	addr = pop();
@@ -801,10 +1798,12 @@ public:
 	else tos(0);
 	continue;
       case 'H': // pin -- | digitalWrite(pin, HIGH)
+	if (!(FEATURES & SHELL_PINS)) goto error;
 	pin = pop();
 	digitalWrite(pin, HIGH);
 	continue;
       case 'I': // pin -- | pinMode(pin, INPUT)
+	if (!(FEATURES & SHELL_PINS)) goto error;
 	pin = pop();
 	pinMode(pin, INPUT);
 	continue;
@@ -818,6 +1817,7 @@ public:
 	}
 	continue;
       case 'L': // pin -- | digitalWrite(pin, LOW)
+	if (!(FEATURES & SHELL_PINS)) goto error;
 	pin = pop();
 	digitalWrite(pin, LOW);
 	continue;
@@ -827,35 +1827,43 @@ public:
       case 'N': // -- | no operation
 	continue;
       case 'O': // pin -- | pinMode(pin, OUTPUT)
+	if (!(FEATURES & SHELL_PINS)) goto error;
 	pin = pop();
 	pinMode(pin, OUTPUT);
 	continue;
       case 'P': // value pin -- | analogWrite(pin, value)
+	if (!(FEATURES & SHELL_ANALOG)) goto error;
 	pin = pop();
 	w = pop();
 	analogWrite(pin, w);
 	continue;
       case 'R': // pin -- bool | digitalRead(pin)
+	if (!(FEATURES & SHELL_PINS)) goto error;
 	pin = tos();
 	tos(as_bool(digitalRead(pin)));
 	continue;
       case 'S': // -- | print stack contents
+	if (!(FEATURES & SHELL_OUTPUT)) goto error;
 	print();
 	continue;
       case 'U': // pin -- | pinMode(pin, INPUT_PULLUP)
+	if (!(FEATURES & SHELL_PINS)) goto error;
 	pin = pop();
 	pinMode(pin, INPUT_PULLUP);
 	continue;
       case 'W': // value pin -- | digitalWrite(pin, value)
+	if (!(FEATURES & SHELL_PINS)) goto error;
 	pin = pop();
 	w = pop();
 	digitalWrite(pin, w);
 	continue;
       case 'X': // pin -- | digitalToggle(pin)
+	if (!(FEATURES & SHELL_PINS)) goto error;
 	pin = pop();
 	digitalWrite(pin, !digitalRead(pin));
 	continue;
       case 'Y': // -- | words
+	if (!(FEATURES & SHELL_DICTIONARY)) goto error;
 	words();
 	continue;
       case 'Z': // -- | toggle trace mode
@@ -894,7 +1902,7 @@ public:
     m_fp = fp;
 
     // Check for no errors
-    if (op == 0 || op == '}') return (NULL);
+    if (op == 0 || op == '}') return;
 
     // Check for trace mode and error print
   error:
@@ -907,10 +1915,13 @@ public:
       m_ios.println(F("^--?"));
     }
 
-    // Return error position
-    return (ip);
+    // Unwind with error position; operations in threaded code fail
+    // in the threaded script
+    raise((script == m_step) ? m_thread : mem->as_addr(ip), -1);
   }
 
+public:
+
   /**
    * Execute given script in program memory (null terminated sequence
    * of operation codes). Return NULL if successful otherwise script
@@ -934,10 +1945,31 @@ public:
     return (NULL);
   }
 
+  /**
+   * Execute native (compiled) code for application script with given
+   * index. Return positive value if executed, negative error code if
+   * failed, or zero if the script is not compiled and should be
+   * interpreted. Scripts are always interpreted in trace mode. See
+   * extras/shellc.py.
+   * @param[in] index application script index.
+   * @return positive, zero or negative error code.
+   */
+  virtual int native(int index)
+  {
+    (void) index;
+    return (0);
+  }
+
 protected:
   /** Max length of name. */
   static const size_t NAME_MAX = 16;
 
+  /** Number of bits in cell. */
+  static const int CELL_BITS = sizeof(int) * 8;
+
+  /** Max number of interned string literals. */
+  static const uint8_t STR_MAX = 8;
+
   /** Trap operation code prefix. */
   static const char TRAP_OP_CODE = '_';
 
@@ -948,16 +1980,240 @@ protected:
    */
   typedef char (*next_fn)(const char* src);
 
+  /** Dictionary entry variable cell for functions (no cell). */
+  static const uint8_t NO_CELL = 0xff;
+
+  /** Dictionary entry variable cell for vocabularies. */
+  static const uint8_t VOCABULARY = 0xfe;
+
+  /** Variable cells are one byte in dictionary entries. */
+  static_assert(VAR_MAX <= VOCABULARY, "VAR_MAX must be 254 or less");
+
+  /** End of vocabulary chain, and root vocabulary. */
+  static const uint16_t NO_ENTRY = 0xffff;
+
+  /** Max number of vocabularies in search order. */
+  static const uint8_t ORDER_MAX = 4;
+
+  /** Dictionary entry attribute; inline function or constant. */
+  static const uint8_t INLINE = 0x01;
+
+  /** Dictionary entry attribute; function source follows script. */
+  static const uint8_t SPLICED = 0x02;
+
+  /** Dictionary entry attribute; variable value is array block. */
+  static const uint8_t ARRAY = 0x04;
+
+  /** Max size of function inlined without attribute. */
+  static const uint8_t INLINE_MAX = 8;
+
+  /** Max nesting of inlined function updates. */
+  static const uint8_t INLINE_DEPTH = 4;
+
+  /** Eeprom header magic; layout version and dictionary size. */
+  static const uint16_t MAGIC = 0x5300 + DICT_MAX;
+
+  /** Eeprom address of header magic, after pointer, entries and root. */
+  static const size_t MAGIC_ADDR = sizeof(char*) + 2 * sizeof(uint16_t);
+
+  /** Size of eeprom header; dictionary pointer, entries, root and magic. */
+  static const size_t HEADER_SIZE = MAGIC_ADDR + sizeof(uint16_t);
+
+  /** Exception code for abort on execution limit (not caught). */
+  static const int ABORT_CODE = -2;
+
+  /** Max loop nesting in threaded code. */
+  static const uint8_t LOOP_MAX = 4;
+
+  /** Number of call counters for tiered execution. */
+  static const uint8_t HOT_MAX = 8;
+
+  /** Default promotion threshold (calls). */
+  static const uint8_t HOT_THRESHOLD = 8;
+
+  /** Call counter marked as not promotable. */
+  static const uint8_t NOT_HOT = 0xff;
+
+  /**
+   * Queue header; capacity, put and get index (0..2*capacity-1), and
+   * overflow counter. The elements follow the header.
+   */
+  enum {
+    QUEUE_SIZE,
+    QUEUE_PUT,
+    QUEUE_GET,
+    QUEUE_OVERFLOW,
+    QUEUE_HEADER
+  };
+
+  /**
+   * Debouncer header; number of pins, debounced state, vertical
+   * counters and accumulated events. The pins follow the header.
+   */
+  enum {
+    DEBOUNCE_PINS,
+    DEBOUNCE_STATE,
+    DEBOUNCE_CNT0,
+    DEBOUNCE_CNT1,
+    DEBOUNCE_EVENTS,
+    DEBOUNCE_HEADER
+  };
+
+  /** Stepper axis state (in a cell array). */
+  struct axis_t {
+    uint32_t velocity;		//!< Steps per tick (0.32 fixed-point).
+    uint32_t vmax;		//!< Max velocity (steps per tick).
+    uint32_t vmin;		//!< Min velocity (steps per tick).
+    uint32_t accel;		//!< Acceleration (steps per tick squared).
+    uint32_t phase;		//!< Step phase accumulator.
+    int position;		//!< Position (steps).
+    int remaining;		//!< Steps to target.
+    int ramp;			//!< Steps in acceleration.
+    int log;			//!< Step timeline queue or negative.
+    uint32_t ticks;		//!< Ticks since start of move.
+    uint16_t rate;		//!< Tick rate (Hz).
+    uint8_t step;		//!< Step pin.
+    uint8_t dir;		//!< Direction pin.
+    int8_t sign;		//!< Direction of move (1 or -1).
+    uint8_t state;		//!< Motion state.
+    uint8_t level;		//!< Step pin level.
+  };
+
+  /** Stepper motion states. */
+  enum {
+    AXIS_IDLE,
+    AXIS_ACCEL,
+    AXIS_CRUISE,
+    AXIS_DECEL
+  };
+
+  /** Number of cells for stepper axis state. */
+  static const int AXIS_CELLS = (sizeof(axis_t) + sizeof(int) - 1) / sizeof(int);
+
+  /** Bus transfer block size (bytes); fits the Wire library buffer. */
+  static const uint8_t BUS_CHUNK = 16;
+
+  /** Max queue capacity; indices fit in a byte (no torn updates). */
+  static const int QUEUE_MAX = 127;
+
+  /** Tiers; interpreted, threaded and native (compiled) code. */
+  enum {
+    TIER_TEXT,
+    TIER_THREADED,
+    TIER_NATIVE
+  };
+
+  /** Call counter for tiered execution. */
+  struct count_t {
+    const char* script;		//!< Script address (linear).
+    uint8_t count;		//!< Number of calls or NOT_HOT.
+  };
+
+  /**
+   * Threaded code handlers; index in handler table. The handlers from
+   * OP_NEG are in the order of the operation codes in translate().
+   */
+  enum {
+    OP_EXIT,			//!< Restore frame pointer and return.
+    OP_END,			//!< Return (end of block).
+    OP_LIT,			//!< Push inline value.
+    OP_JMP,			//!< Jump to inline offset.
+    OP_JZ,			//!< Jump to inline offset if false.
+    OP_JNZ,			//!< Jump to inline offset if true.
+    OP_LOOP,			//!< Start loop; inline exit offset.
+    OP_NEXT,			//!< Next loop index; inline body offset.
+    OP_VAR,			//!< Push address of inline entry.
+    OP_CALL,			//!< Call inline entry.
+    OP_TYPE,			//!< Write inline string (address, length).
+    OP_STR,			//!< Push inline string (address, length).
+    OP_BLOCK,			//!< Push inline block (address, length).
+    OP_DEFINE,			//!< Copy block to variable.
+    OP_INTERPRET,		//!< Interpret inline operation code.
+    OP_NEG,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_SCALE,
+    OP_EQ,
+    OP_NE,
+    OP_LT,
+    OP_GT,
+    OP_NOT,
+    OP_AND,
+    OP_OR,
+    OP_XOR,
+    OP_NDROP,
+    OP_DROP,
+    OP_ROLL,
+    OP_DEPTH,
+    OP_OVER,
+    OP_PICK,
+    OP_ROT,
+    OP_SWAP,
+    OP_QDUP,
+    OP_DUP,
+    OP_FETCH,
+    OP_STORE,
+    OP_FRAME,
+    OP_FRAME_ADDR,
+    OP_DOT,
+    OP_CR,
+    OP_EMIT
+  };
+
   /** Dictionary entry (in eeprom). */
   struct dict_t {
     const char* name;		//!< Name string (in eeprom).
-    int value;			//!< Value persistent.
+    int value;			//!< Value persistent, function script or
+				//!< vocabulary head.
+    uint16_t link;		//!< Previous entry in vocabulary.
+    uint8_t cell;		//!< Variable cell, NO_CELL or VOCABULARY.
+    uint8_t attr;		//!< Attributes; INLINE and SPLICED.
+  };
+
+  /** Interned string literal. */
+  struct str_t {
+    const char* addr;		//!< Literal address (linear).
+    const char* str;		//!< Interned string address (linear).
+    uint8_t len;		//!< String length.
+  };
+
+  /**
+   * Output block buffer; collects formatted output and writes it to
+   * the stream in blocks instead of character by character.
+   */
+  struct out_t {
+    Stream& ios;		//!< Output stream.
+    uint8_t len;		//!< Number of buffered characters.
+    char buf[16];		//!< Buffered characters.
+
+    out_t(Stream& s) : ios(s), len(0) {}
+
+    void put(char c)
+    {
+      if (len == sizeof(buf)) flush();
+      buf[len++] = c;
+    }
+
+    void flush()
+    {
+      if (len == 0) return;
+      ios.write((const uint8_t*) buf, len);
+      len = 0;
+    }
   };
 
   const script_t* m_scripts;	//!< Application scripts (in progmem).
   char* m_dp;			//!< Dictionary pointer (in eeprom).
   dict_t* m_dict;		//!< Dictionary (in eeprom).
-  uint8_t m_entries;		//!< Dictionary entries.
+  uint16_t m_entries;		//!< Dictionary entries.
+  uint16_t m_root;		//!< Root vocabulary head.
+  uint16_t m_current;		//!< Definitions vocabulary.
+  uint16_t m_order[ORDER_MAX];	//!< Vocabulary search order.
+  uint8_t m_orders;		//!< Vocabularies in search order.
+  uint8_t m_vars;		//!< Allocated variables.
   int* m_fp;			//!< Frame pointer.
   int* m_sp;			//!< Stack pointer.
   int m_tos;			//!< Top of stack register.
@@ -965,9 +2221,32 @@ protected:
   bool m_trace;			//!< Trace mode.
   unsigned m_cycle;		//!< Cycle counter.
   int m_base;			//!< Number print base.
+  uint8_t m_strs;		//!< Number of interned strings.
+  int m_ap;			//!< Arena pointer (cells used).
+  uint8_t m_runs;		//!< Threaded code nesting.
+  uint8_t m_threshold;		//!< Promotion threshold (calls).
+  uint16_t m_promotions;	//!< Number of promotions.
+  uint16_t m_calls[3];		//!< Calls per tier.
+  jmp_buf* m_catch;		//!< Current exception handler.
+  const char* m_error;		//!< Error position.
+  const char* m_step;		//!< Operation interpreted from threaded code.
+  const char* m_thread;		//!< Threaded script (error position).
+  jmp_buf* m_top;		//!< Top level handler (abort).
+  uint8_t m_ticks;		//!< Operation counter (limit check).
+  uint16_t m_rounds;		//!< Number of 256 operations.
+  uint16_t m_time_limit;	//!< Time limit per command (ms).
+  uint16_t m_op_limit;		//!< Operation limit per command (256 ops).
+  unsigned long m_start;	//!< Command start time (ms).
+  uint32_t m_seed;		//!< Random number generator state.
+  int m_device_regs;		//!< Fake I2C device registers (cell array).
+  uint8_t m_device;		//!< Fake I2C device address.
+  uint8_t m_device_size;	//!< Fake I2C device number of registers.
   Stream& m_ios;		//!< Input/output Stream.
   int m_var[VAR_MAX];		//!< Variable table.
   int m_stack[STACK_MAX];	//!< Parameter stack.
+  str_t m_str[STR_MAX];		//!< Interned string literals.
+  int m_arena[ARENA_MAX > 0 ? ARENA_MAX : 1]; //!< Threaded code.
+  count_t m_count[ARENA_MAX > 0 ? HOT_MAX : 1]; //!< Call counters.
 
   /**
    * Map given integer value to boolean (true(-1) and false(0)).
@@ -1029,6 +2308,11 @@ protected:
     case 'x': return (F("execute"));
     case 'y': return (F("yield"));
     case 'z': return (F("zap"));
+    case 'B': return (F("bit"));
+    case 'G': return (F("string"));
+    case 'J': return (F("system"));
+    case 'Q': return (F("queue"));
+    case 'V': return (F("vector"));
     case 'A': return (F("analogRead"));
     case 'C': return (F("clear"));
     case 'D': return (F("delay"));
@@ -1242,16 +2526,19 @@ protected:
   {
     int i = 0;
 
-    // Lookup entry in dictionary
-    for (; i < m_entries; i++) {
-      const uint8_t* np =
-	(const uint8_t*) eeprom_read_word((const uint16_t*) &m_dict[i].name);
-      size_t j = 0;
-      for (; j < len; j++)
-	if (name[j] != (char) eeprom_read_byte(np++))
-	  break;
-      if (j == len && (eeprom_read_byte(np) == 0))
-	return (i);
+    // Lookup entry in vocabularies in search order and root
+    for (uint8_t k = 0; (FEATURES & SHELL_DICTIONARY) && k <= m_orders; k++) {
+      uint16_t e = (k < m_orders) ? head(m_order[k]) : m_root;
+      for (; e != NO_ENTRY; e = eeprom_read_word(&m_dict[e].link)) {
+	const uint8_t* np =
+	  (const uint8_t*) eeprom_read_word((const uint16_t*) &m_dict[e].name);
+	size_t j = 0;
+	for (; j < len; j++)
+	  if (name[j] != (char) eeprom_read_byte(np++))
+	    break;
+	if (j == len && (eeprom_read_byte(np) == 0))
+	  return (e);
+      }
     }
 
     // Lookup entry in application dictionary
@@ -1259,29 +2546,2085 @@ protected:
       const char* np;
       i = 0;
       while ((np = (const char*) pgm_read_word(&m_scripts[i].name)) != NULL) {
-	if (!strcmp_P(name, np)) return (VAR_MAX + i);
+	if (!strcmp_P(name, np)) return (DICT_MAX + i);
 	i += 1;
       }
     }
 
-    // Check if dictionary is full
-    if (m_entries == VAR_MAX || !flag) return (-1);
+    // Check if dictionary or eeprom is full
+    if (m_entries == DICT_MAX || !flag || !(FEATURES & SHELL_DICTIONARY)) return (-1);
+    if ((size_t) m_dp + len + 1 > SHELL_EEPROM_SIZE) return (-1);
     i = m_entries;
 
-    // Add entry to dictionary
+    // Add entry to current vocabulary; variable cell is allocated on write
     eeprom_update_block(&m_dp, &m_dict[i].name, sizeof(m_dp));
+    eeprom_update_word((uint16_t*) &m_dict[i].value, 0);
+    eeprom_update_byte(&m_dict[i].cell, NO_CELL);
+    eeprom_update_byte(&m_dict[i].attr, 0);
+    eeprom_update_word(&m_dict[i].link, head(m_current));
+    head(m_current, i);
     eeprom_update_block(name, m_dp, len);
     m_dp += len;
     eeprom_update_byte((uint8_t*) m_dp, 0);
     m_dp += 1;
     eeprom_update_block(&m_dp, 0, sizeof(m_dp));
     m_entries += 1;
-    eeprom_update_byte((uint8_t*) sizeof(m_dp), m_entries);
-    m_var[i] = 0;
+    eeprom_update_word((uint16_t*) sizeof(m_dp), m_entries);
+
+    // The new entry may hide a name bound in threaded code
+    unthread();
 
     // Return entry index
     return (i);
   }
+
+  /**
+   * Return dictionary entry index for given variable or function
+   * address, or negative error code.
+   * @param[in] addr variable or function address.
+   * @return entry index or negative error code.
+   */
+  int entry(int addr)
+  {
+    if (addr >= 0x2000 && addr < 0x2000 + m_entries) return (addr - 0x2000);
+    if (addr >= 0 && addr < m_vars) {
+      for (int i = m_entries - 1; i >= 0; i--)
+	if (eeprom_read_byte(&m_dict[i].cell) == addr) return (i);
+    }
+    return (-1);
+  }
+
+  /**
+   * Return address of given dictionary entry; variable address if a
+   * cell has been allocated otherwise function (or vocabulary) address.
+   * @param[in] i entry index.
+   * @return address.
+   */
+  int address(int i)
+  {
+    uint8_t cell = eeprom_read_byte(&m_dict[i].cell);
+    return (cell < VAR_MAX ? cell : 0x2000 + i);
+  }
+
+  /**
+   * Return variable address of given dictionary entry. A cell is
+   * allocated on first use. Returns negative error code if the
+   * variable table is full.
+   * @param[in] i entry index.
+   * @return variable address or negative error code.
+   */
+  int variable(int i)
+  {
+    uint8_t cell = eeprom_read_byte(&m_dict[i].cell);
+    if (cell == VOCABULARY) return (-1);
+    if (cell != NO_CELL) return (cell);
+    if (m_vars == VAR_MAX) return (-1);
+    cell = m_vars++;
+    m_var[cell] = 0;
+    eeprom_update_byte(&m_dict[i].cell, cell);
+    return (cell);
+  }
+
+  /**
+   * Define given dictionary entry as function with given script. The
+   * script address is kept in the dictionary (in eeprom) and the
+   * variable cell, if any, is released when last allocated.
+   * @param[in] i entry index.
+   * @param[in] script address.
+   */
+  void define(int i, const char* script)
+  {
+    uint8_t cell = eeprom_read_byte(&m_dict[i].cell);
+    if (cell != NO_CELL) {
+      if (cell + elements(i) == m_vars) m_vars = cell;
+      eeprom_update_byte(&m_dict[i].cell, NO_CELL);
+    }
+    else unthread((const char*) eeprom_read_word((const uint16_t*) &m_dict[i].value));
+    eeprom_update_word((uint16_t*) &m_dict[i].value, (uint16_t) script);
+    eeprom_update_byte(&m_dict[i].attr, eeprom_read_byte(&m_dict[i].attr) & ~(SPLICED | ARRAY));
+  }
+
+  /**
+   * Copy given block to eeprom and define the variable at given
+   * address as function with the copy. Returns false if the address
+   * is not a variable or function, or the eeprom is full.
+   * @param[in] addr variable address.
+   * @param[in] src block address.
+   * @param[in] len block length.
+   * @return bool.
+   */
+  bool copy(int addr, const char* src, size_t len)
+  {
+    int i = entry(addr);
+    return (i >= 0 && compile(i, src, len, 0));
+  }
+
+  /**
+   * Define given dictionary entry as function with given block
+   * (linear address). The block is spliced to eeprom; inline functions
+   * and constants are replaced. The block source follows the spliced
+   * script when anything was inlined. Functions that depend on the
+   * entry are updated. Returns false, and the entry is not changed,
+   * if the eeprom is full.
+   * @param[in] i entry index.
+   * @param[in] src block address.
+   * @param[in] len block length.
+   * @param[in] level update nesting.
+   * @return bool.
+   */
+  bool compile(int i, const char* src, size_t len, uint8_t level)
+  {
+    char* dp = m_dp;
+    const char* dest = m_eeprom.as_addr(m_dp);
+    int n = splice(src, len, i, true);
+    put(0);
+    if (n > 0) {
+      Memory* mem = access(src);
+      next_fn next = mem->get_next_fn();
+      const char* p = mem->as_local(src);
+      for (size_t k = 0; k < len; k++) put(next(p++));
+      put(0);
+    }
+    if ((size_t) m_dp > SHELL_EEPROM_SIZE) {
+      m_dp = dp;
+      return (false);
+    }
+    eeprom_update_block(&m_dp, 0, sizeof(m_dp));
+    define(i, dest);
+    if (n > 0)
+      eeprom_update_byte(&m_dict[i].attr, eeprom_read_byte(&m_dict[i].attr) | SPLICED);
+    return (depends(i, level));
+  }
+
+  /**
+   * Update functions that refer to given dictionary entry; functions
+   * with inlined references and, when the entry can be inlined, all
+   * functions with references. The functions are spliced again from
+   * their source. Returns false if the eeprom is full.
+   * @param[in] i entry index.
+   * @param[in] level update nesting.
+   * @return bool.
+   */
+  bool depends(int i, uint8_t level)
+  {
+    if (level == INLINE_DEPTH) return (true);
+    int n;
+    bool flag = (inlinable(i, n) != NULL || constant(i, n));
+    for (uint16_t e = 0; e < m_entries; e++) {
+      if (e == i || eeprom_read_byte(&m_dict[e].cell) != NO_CELL) continue;
+      uint8_t attr = eeprom_read_byte(&m_dict[e].attr);
+      if (!flag && !(attr & SPLICED)) continue;
+      const char* s = (const char*) eeprom_read_word((const uint16_t*) &m_dict[e].value);
+      if (s == NULL) continue;
+      Memory* mem = access(s);
+      next_fn next = mem->get_next_fn();
+      const char* p = mem->as_local(s);
+      if (attr & SPLICED) {
+	while (next(p++) != 0);
+	s = mem->as_addr(p);
+      }
+      for (n = 0; next(p++) != 0; n++);
+      if (splice(s, n, i, false) > 0 && !compile(e, s, n, level + 1)) return (false);
+    }
+    return (true);
+  }
+
+  /**
+   * Splice given block (linear address) to eeprom at dictionary
+   * pointer. Calls of inline functions are replaced by the function
+   * script and fetch of inline variables by the value, with separators.
+   * Literals and references to the defined entry (recursion) are
+   * copied as is. Returns number of inlined references. Without write
+   * nothing is written and the number of references to the given entry
+   * is returned (dependency check).
+   * @param[in] src block address.
+   * @param[in] len block length.
+   * @param[in] dep defined or dependency entry index.
+   * @param[in] write splice or check dependency.
+   * @return number of references.
+   */
+  int splice(const char* src, size_t len, int dep, bool write)
+  {
+    Memory* mem = access(src);
+    next_fn next = mem->get_next_fn();
+    const char* ip = mem->as_local(src);
+    const char* end = ip + len;
+    char last = ',';
+    int res = 0;
+    while (ip < end) {
+      char c = next(ip++);
+
+      // Copy character, string and output string literals
+      if (c == '\'' || c == '"' || c == '(') {
+	char left = c;
+	char right = (c == '(') ? ')' : c;
+	if (write) put(c);
+	int n = (c == '\'') ? 0 : 1;
+	if (c == '\'' && ip < end) {
+	  c = next(ip++);
+	  if (write) put(c);
+	}
+	while (n != 0 && ip < end) {
+	  c = next(ip++);
+	  if (write) put(c);
+	  if (c == right) n--;
+	  else if (c == left) n++;
+	}
+	last = c;
+	continue;
+      }
+
+      // Check for references; call and constant (fetch)
+      if ((c != '`' && c != ':') || ip == end || !isalpha(next(ip))) {
+	if (write) put(c);
+	last = c;
+	continue;
+      }
+      char name[NAME_MAX];
+      const char* np = ip;
+      size_t n = 0;
+      while (ip < end && isalnum(next(ip)) && n < NAME_MAX - 1)
+	name[n++] = next(ip++);
+      name[n] = 0;
+      int i = (ip < end && isalnum(next(ip))) ? -1 : lookup(name, n, false);
+      if (i >= 0 && i < DICT_MAX && (i != dep || !write)) {
+	const char* sp;
+	int w;
+	bool fetch = (c == ':' && ip < end && next(ip) == '@');
+	if (!write) {
+	  if (i == dep) res += 1;
+	}
+	else if (c == '`' && (sp = inlinable(i, w)) != NULL) {
+	  if (last != ',' && last != ' ') put(',');
+	  Memory* mp = access(sp);
+	  next_fn np = mp->get_next_fn();
+	  const char* p = mp->as_local(sp);
+	  while (w--) put(np(p++));
+	  put(last = ',');
+	  res += 1;
+	  continue;
+	}
+	else if (fetch && constant(i, w)) {
+	  char buf[8];
+	  char* bp = buf + sizeof(buf);
+	  unsigned u = (w < 0) ? -w : w;
+	  do {
+	    *--bp = '0' + (u % 10);
+	    u = u / 10;
+	  } while (u != 0);
+	  if (w < 0) *--bp = '-';
+	  if (last != ',' && last != ' ') put(',');
+	  while (bp < buf + sizeof(buf)) put(*bp++);
+	  put(last = ',');
+	  ip += 1;
+	  res += 1;
+	  continue;
+	}
+      }
+
+      // Copy reference as is
+      if (write) {
+	put(c);
+	while (np < ip) put(next(np++));
+      }
+      last = 'a';
+    }
+    return (res);
+  }
+
+  /**
+   * Return script (linear address) of given dictionary entry if the
+   * function may be inlined, otherwise NULL. Functions with the inline
+   * attribute, or with SHELL_INLINE functions that are not longer than
+   * INLINE_MAX, may be inlined if the script is a sequence of
+   * operations; no stack frame, end of block, copy or extended
+   * operation codes.
+   * @param[in] i entry index.
+   * @param[out] len script length.
+   * @return script address or NULL.
+   */
+  const char* inlinable(int i, int& len)
+  {
+    if (eeprom_read_byte(&m_dict[i].cell) != NO_CELL) return (NULL);
+    const char* s = (const char*) eeprom_read_word((const uint16_t*) &m_dict[i].value);
+    if (s == NULL) return (NULL);
+    int max = (eeprom_read_byte(&m_dict[i].attr) & INLINE) ? 255 : INLINE_MAX;
+    if (max == INLINE_MAX && !(FEATURES & SHELL_INLINE)) return (NULL);
+    Memory* mem = access(s);
+    next_fn next = mem->get_next_fn();
+    const char* p = mem->as_local(s);
+    int depth = 0;
+    char c;
+    for (len = 0; (c = next(p++)) != 0; len++) {
+      if (len == max) return (NULL);
+      switch (c) {
+      case '\\':
+      case '$':
+      case ';':
+      case TRAP_OP_CODE:
+	return (NULL);
+      case '{':
+	depth += 1;
+	break;
+      case '}':
+	if (depth-- == 0) return (NULL);
+	break;
+      case '\'':
+	if (next(p) != 0) {
+	  p += 1;
+	  len += 1;
+	}
+	break;
+      case '"':
+      case '(':
+	{
+	  char right = (c == '(') ? ')' : c;
+	  int n = 1;
+	  while (n != 0 && (c = next(p++)) != 0) {
+	    len += 1;
+	    if (c == right) n--;
+	    else if (c == '(' && right == ')') n++;
+	  }
+	  if (c == 0) return (NULL);
+	}
+	break;
+      }
+    }
+    return (depth == 0 ? s : NULL);
+  }
+
+  /**
+   * Return true and the value of given dictionary entry if it is an
+   * inline variable (constant), otherwise false.
+   * @param[in] i entry index.
+   * @param[out] value of variable.
+   * @return bool.
+   */
+  bool constant(int i, int& value)
+  {
+    uint8_t cell = eeprom_read_byte(&m_dict[i].cell);
+    if (cell >= VAR_MAX || !(eeprom_read_byte(&m_dict[i].attr) & INLINE))
+      return (false);
+    value = m_var[cell];
+    return (true);
+  }
+
+  /**
+   * Append given character to eeprom at dictionary pointer. Nothing
+   * is written beyond the end of the eeprom but the pointer is still
+   * advanced so that the caller may check for overflow.
+   * @param[in] c character.
+   */
+  void put(char c)
+  {
+    if ((size_t) m_dp < SHELL_EEPROM_SIZE) eeprom_update_byte((uint8_t*) m_dp, c);
+    m_dp += 1;
+  }
+
+  /**
+   * Call function with given entry index; dictionary entry or
+   * application script (DICT_MAX + index). Compiled application
+   * scripts are called directly. Returns true if successful
+   * otherwise false.
+   * @param[in] i entry index.
+   * @return bool.
+   */
+  bool call(int i)
+  {
+    const char* sp;
+    if (i < DICT_MAX) {
+      sp = (const char*) read(i + 0x2000);
+      if (sp == NULL) return (false);
+    }
+    else {
+      i = i - DICT_MAX;
+      if (!m_trace) {
+	int res = native(i);
+	if (res != 0) {
+	  m_calls[TIER_NATIVE] += 1;
+	  return (res > 0);
+	}
+      }
+      sp = m_progmem.as_addr((const char*) pgm_read_word(&m_scripts[i].code));
+    }
+    m_calls[promote(sp) ? TIER_THREADED : TIER_TEXT] += 1;
+    interpret(sp);
+    return (true);
+  }
+
+  /**
+   * Interpret given script with exception handler. Returns zero if
+   * successful otherwise the exception code (-1 for errors). The
+   * parameter stack depth, frame pointer and stack marker are restored
+   * on exception.
+   * @param[in] script.
+   * @return exception code.
+   */
+  int protect(const char* script)
+  {
+    jmp_buf env;
+    jmp_buf* handler = m_catch;
+    int* sp = m_sp;
+    int tos = m_tos;
+    int* fp = m_fp;
+    int marker = m_marker;
+    uint8_t runs = m_runs;
+    const char* error = m_error;
+    const char* step = m_step;
+    const char* thread = m_thread;
+    int res = setjmp(env);
+    if (res == 0) {
+      m_catch = &env;
+      interpret(script);
+    }
+    else {
+      m_sp = sp;
+      m_tos = tos;
+      m_fp = fp;
+      m_marker = marker;
+      m_runs = runs;
+      m_error = error;
+      m_step = step;
+      m_thread = thread;
+    }
+    m_catch = handler;
+    return (res);
+  }
+
+  /**
+   * Unwind to the current exception handler with given error position
+   * and exception code.
+   * @param[in] ip error position (linear address).
+   * @param[in] code exception code (not zero).
+   */
+  void raise(const char* ip, int code)
+  {
+    m_error = ip;
+    longjmp(*m_catch, code);
+  }
+
+  /**
+   * Check execution limits; called every 256 operations. Aborts to
+   * the top level with given position if a limit is exceeded.
+   * @param[in] ip position (linear address).
+   */
+  void tick(const char* ip)
+  {
+    m_rounds += 1;
+    if ((m_op_limit != 0 && m_rounds >= m_op_limit)
+	|| (m_time_limit != 0 && millis() - m_start >= m_time_limit)) {
+      m_error = ip;
+      longjmp(*m_top, ABORT_CODE);
+    }
+  }
+
+  /**
+   * Count call of given script and translate the script to threaded
+   * code when the number of calls reaches the promotion threshold.
+   * Scripts that cannot be threaded are not counted further while
+   * they keep their counter. When all counters are in use a counter
+   * of a script that cannot be threaded is reused first, otherwise
+   * the least called counter.
+   * Returns true if the script is threaded otherwise false.
+   * @param[in] script address.
+   * @return bool.
+   */
+  bool promote(const char* script)
+  {
+    if (ARENA_MAX == 0 || m_trace) return (false);
+    if (threaded(script) != NULL) return (true);
+    if (m_threshold == 0 || access(script) == &m_memory) return (false);
+    uint8_t k, j = 0;
+    for (k = 0; k < HOT_MAX; k++) {
+      if (m_count[k].script == script) break;
+      if (m_count[j].count == NOT_HOT) continue;
+      if (m_count[k].count < m_count[j].count || m_count[k].count == NOT_HOT) j = k;
+    }
+    if (k == HOT_MAX) {
+      k = j;
+      m_count[k].script = script;
+      m_count[k].count = 0;
+    }
+    if (m_count[k].count == NOT_HOT) return (false);
+    if (++m_count[k].count < m_threshold) return (false);
+    if (!thread(script)) {
+      m_count[k].count = NOT_HOT;
+      return (false);
+    }
+    m_count[k].script = NULL;
+    m_count[k].count = 0;
+    m_promotions += 1;
+    return (true);
+  }
+
+  /**
+   * Forget given dictionary entry and all entries defined after it.
+   * Variables, vocabulary chains, search order and interned strings
+   * are updated accordingly.
+   * @param[in] w entry index.
+   */
+  void forget(int w)
+  {
+    uint16_t i;
+
+    // Release variables of forgotten entries and unlink from vocabularies
+    m_vars = 0;
+    for (i = 0; i < (uint16_t) w; i++) {
+      uint8_t cell = eeprom_read_byte(&m_dict[i].cell);
+      if (cell < VAR_MAX && cell + elements(i) > m_vars) m_vars = cell + elements(i);
+      if (cell == VOCABULARY) {
+	uint16_t e = head(i);
+	while (e != NO_ENTRY && e >= w) e = eeprom_read_word(&m_dict[e].link);
+	head(i, e);
+      }
+    }
+    while (m_root != NO_ENTRY && m_root >= w)
+      m_root = eeprom_read_word(&m_dict[m_root].link);
+    eeprom_update_word((uint16_t*) (sizeof(m_dp) + sizeof(m_entries)), m_root);
+    for (uint8_t k = 0; k < m_orders; ) {
+      if (m_order[k] >= w) {
+	for (uint8_t j = k + 1; j < m_orders; j++) m_order[j - 1] = m_order[j];
+	m_orders -= 1;
+      }
+      else k++;
+    }
+    if (m_current != NO_ENTRY && m_current >= w) m_current = NO_ENTRY;
+
+    // Threaded code may refer to forgotten entries; restart counting
+    unthread();
+
+    // Reset dictionary pointer
+    m_entries = w;
+    m_dp = (char*) eeprom_read_word((const uint16_t*) &m_dict[w].name);
+    eeprom_update_block(&m_dp, 0, sizeof(m_dp));
+    eeprom_update_word((uint16_t*) sizeof(m_dp), m_entries);
+
+    // Forget interned strings in released eeprom
+    int dp = (int) m_eeprom.as_addr(m_dp);
+    for (uint8_t k = 0; k < m_strs; ) {
+      if ((int) m_str[k].addr >= dp || (int) m_str[k].str >= dp)
+	m_str[k] = m_str[--m_strs];
+      else k++;
+    }
+  }
+
+  /**
+   * Return head (latest entry) of given vocabulary chain.
+   * @param[in] voc vocabulary entry index or NO_ENTRY for root.
+   * @return entry index or NO_ENTRY.
+   */
+  uint16_t head(uint16_t voc)
+  {
+    if (voc == NO_ENTRY) return (m_root);
+    return (eeprom_read_word((const uint16_t*) &m_dict[voc].value));
+  }
+
+  /**
+   * Set head (latest entry) of given vocabulary chain.
+   * @param[in] voc vocabulary entry index or NO_ENTRY for root.
+   * @param[in] e entry index or NO_ENTRY.
+   */
+  void head(uint16_t voc, uint16_t e)
+  {
+    if (voc == NO_ENTRY) {
+      m_root = e;
+      eeprom_update_word((uint16_t*) (sizeof(m_dp) + sizeof(m_entries)), m_root);
+    }
+    else eeprom_update_word((uint16_t*) &m_dict[voc].value, e);
+  }
+
+  /**
+   * Return number of cells of given dictionary entry variable; the
+   * array length or one.
+   * @param[in] i entry index.
+   * @return number of cells.
+   */
+  uint16_t elements(int i)
+  {
+    if (!(eeprom_read_byte(&m_dict[i].attr) & ARRAY)) return (1);
+    const uint16_t* bp =
+      (const uint16_t*) eeprom_read_word((const uint16_t*) &m_dict[i].value);
+    return (eeprom_read_word(bp));
+  }
+
+  /**
+   * Write variable or array element with given address to eeprom.
+   * Array elements are saved in the array block. Other addresses
+   * are ignored.
+   * @param[in] addr variable address.
+   */
+  void save(int addr)
+  {
+    if (addr >= 0x2000 && addr < 0x2000 + m_entries) addr = address(addr - 0x2000);
+    if (addr < 0 || addr >= m_vars) return;
+    for (int i = m_entries - 1; i >= 0; i--) {
+      uint8_t cell = eeprom_read_byte(&m_dict[i].cell);
+      if (cell > addr || addr >= cell + elements(i)) continue;
+      uint16_t* vp = (uint16_t*) &m_dict[i].value;
+      if (eeprom_read_byte(&m_dict[i].attr) & ARRAY)
+	vp = (uint16_t*) eeprom_read_word(vp) + 1 + (addr - cell);
+      eeprom_write_word(vp, (uint16_t) m_var[addr]);
+      return;
+    }
+  }
+
+  /**
+   * Allot variable with given number of elements. The variable keeps
+   * its dictionary entry and the elements are the following cells.
+   * The length and the saved values are kept in an array block in
+   * eeprom; two bytes per element and two for the length. Returns
+   * true if the variable already has the elements or they could be
+   * appended, otherwise false. The variable cells must be the last
+   * allocated.
+   * @param[in] addr variable address.
+   * @param[in] n number of elements.
+   * @return bool.
+   */
+  bool allot(int addr, int n)
+  {
+    int i = entry(addr);
+    if (i < 0 || n < 1) return (false);
+    int cell = variable(i);
+    if (cell < 0 || cell + n > VAR_MAX) return (false);
+    int k = elements(i);
+    if (n <= k) return (true);
+    if (m_vars != cell + k) return (false);
+    if ((size_t) m_dp + sizeof(uint16_t) * (n + 1) > SHELL_EEPROM_SIZE) return (false);
+
+    // Write new array block with length and saved values
+    const uint16_t* vp = (const uint16_t*) &m_dict[i].value;
+    if (k > 1) vp = (const uint16_t*) eeprom_read_word(vp) + 1;
+    uint16_t* bp = (uint16_t*) m_dp;
+    eeprom_update_word(bp++, n);
+    for (int j = 0; j < n; j++)
+      eeprom_update_word(bp++, (j < k) ? eeprom_read_word(vp++) : 0);
+    eeprom_update_word((uint16_t*) &m_dict[i].value, (uint16_t) (uintptr_t) m_dp);
+    eeprom_update_byte(&m_dict[i].attr, eeprom_read_byte(&m_dict[i].attr) | ARRAY);
+    m_dp = (char*) bp;
+    eeprom_update_block(&m_dp, 0, sizeof(m_dp));
+
+    // Allocate the element cells
+    while (m_vars < cell + n) m_var[m_vars++] = 0;
+    return (true);
+  }
+
+  /**
+   * Return pointer to given cell array (variable address) with given
+   * number of elements, or NULL if out of bounds.
+   * @param[in] addr variable address.
+   * @param[in] n number of elements.
+   * @return pointer or NULL.
+   */
+  int* array(int addr, int n)
+  {
+    if (addr < 0 || n < 0 || addr + n > (VAR_MAX + STACK_MAX)) return (NULL);
+    return (&m_var[addr]);
+  }
+
+  /**
+   * Transfer between given cell array and bus in blocks of BUS_CHUNK
+   * bytes; the low byte of each cell is sent and the received byte is
+   * stored. SPI transfer is in-place with chip select (active low)
+   * held during the transfer, if the pin is not negative. I2C register
+   * block read ('R') or write ('W'). Returns false if the cell array
+   * is out of bounds or the device did not acknowledge.
+   * @param[in] op operation code ('S', 'R' or 'W').
+   * @param[in] addr cell array.
+   * @param[in] n number of cells.
+   * @param[in] dev chip select pin (SPI) or device address (I2C).
+   * @param[in] reg register address (I2C).
+   * @return bool.
+   */
+  bool transfer(char op, int addr, int n, int dev, int reg)
+  {
+    int* vp = array(addr, n);
+    if (vp == NULL) return (false);
+    uint8_t buf[BUS_CHUNK];
+    bool res = true;
+    if (op == 'S' && dev >= 0) digitalWrite(dev, LOW);
+    while (n > 0 && res) {
+      uint8_t m = (n < BUS_CHUNK) ? n : BUS_CHUNK;
+      for (uint8_t i = 0; i < m; i++) buf[i] = vp[i];
+      if (op == 'S')
+	res = spi(buf, m);
+      else
+	res = i2c(dev, reg, buf, m, op == 'R');
+      if (op != 'W')
+	for (uint8_t i = 0; i < m; i++) vp[i] = buf[i];
+      vp += m;
+      n -= m;
+      reg += m;
+    }
+    if (op == 'S' && dev >= 0) digitalWrite(dev, HIGH);
+    return (res);
+  }
+
+  /**
+   * Return pointer to given stepper axis (variable address), or NULL
+   * if not initiated or out of bounds.
+   * @param[in] addr axis cell array.
+   * @return pointer or NULL.
+   */
+  axis_t* as_axis(int addr)
+  {
+    axis_t* ap = (axis_t*) array(addr, AXIS_CELLS);
+    if (ap == NULL || ap->rate == 0 || ap->state > AXIS_DECEL) return (NULL);
+    return (ap);
+  }
+
+  /**
+   * Return given numerator divided by denominator in 16.16
+   * fixed-point, without 64-bit arithmetic.
+   * @param[in] num numerator.
+   * @param[in] den denominator.
+   * @return ratio.
+   */
+  static uint32_t ratio(uint32_t num, uint16_t den)
+  {
+    return (((num / den) << 16) + (((num % den) << 16) / den));
+  }
+
+  /**
+   * Return pointer to given debouncer (variable address), or NULL if
+   * the header is not valid or out of bounds.
+   * @param[in] addr debouncer cell array.
+   * @return pointer or NULL.
+   */
+  int* as_debounce(int addr)
+  {
+    int* dp = array(addr, DEBOUNCE_HEADER);
+    if (dp == NULL) return (NULL);
+    int n = dp[DEBOUNCE_PINS];
+    if (n < 1 || n > CELL_BITS || array(addr, DEBOUNCE_HEADER + n) == NULL)
+      return (NULL);
+    return (dp);
+  }
+
+  /**
+   * Sample the pins of given debouncer; one bit per pin.
+   * @param[in] dp debouncer.
+   * @return pin levels.
+   */
+  unsigned sample(const int* dp)
+  {
+    unsigned res = 0;
+    for (int i = dp[DEBOUNCE_PINS] - 1; i >= 0; i--)
+      res = (res << 1) | (digitalRead(dp[DEBOUNCE_HEADER + i]) != LOW);
+    return (res);
+  }
+
+  /**
+   * Return pointer to given queue (variable address), or NULL if the
+   * queue header is not valid or out of bounds.
+   * @param[in] addr queue cell array.
+   * @return pointer or NULL.
+   */
+  int* as_queue(int addr)
+  {
+    int* qp = array(addr, QUEUE_HEADER);
+    if (qp == NULL) return (NULL);
+    int n = qp[QUEUE_SIZE];
+    if (n < 1 || n > QUEUE_MAX || array(addr, QUEUE_HEADER + n) == NULL)
+      return (NULL);
+    return (qp);
+  }
+
+  /**
+   * Return given sum plus product of given values, saturated to the
+   * 32-bit range. Cells and coefficients are 16-bit (AVR), so a
+   * product is at most 2^30 and a sum of two full scale products may
+   * overflow without saturation. With wider cells the product itself
+   * is not checked.
+   * @param[in] sum accumulator.
+   * @param[in] h coefficient.
+   * @param[in] x value.
+   * @return saturated sum.
+   */
+  static int32_t mac(int32_t sum, int h, int x)
+  {
+    int32_t p = (int32_t) h * x;
+    int32_t res;
+    if (__builtin_add_overflow(sum, p, &res)) return (p < 0 ? INT32_MIN : INT32_MAX);
+    return (res);
+  }
+
+  /**
+   * FIR filter (convolution) or cross-correlation of given cell array
+   * with coefficient table; cell array or table of 16-bit values in
+   * program memory (linear address). Fixed-point multiply-accumulate
+   * with saturated 32-bit sum, scaled with given shift and saturated.
+   * Only output elements where the coefficients overlap the input are
+   * calculated (n-m+1). The
+   * output may be the input array (in-place). Returns number of output
+   * elements or negative error code.
+   * @param[in] flip convolution (true) or correlation (false).
+   * @param[in] dst output cell array.
+   * @param[in] src input cell array.
+   * @param[in] n number of input elements.
+   * @param[in] coef coefficient table.
+   * @param[in] m number of coefficients.
+   * @param[in] shift fixed-point scale (e.g. 15 for Q15).
+   * @return number of output elements or negative error code.
+   */
+  int fir(bool flip, int dst, int src, int n, int coef, int m, uint8_t shift)
+  {
+    int count = n - m + 1;
+    int* yp = array(dst, count);
+    const int* xp = array(src, n);
+    if (m < 1 || count < 1 || yp == NULL || xp == NULL || shift > 31) return (-1);
+    const int* hp = array(coef, m);
+    const int16_t* pp = NULL;
+    if (hp == NULL) {
+      if (access((const char*) coef) != &m_progmem) return (-1);
+      pp = (const int16_t*) m_progmem.as_local((const char*) coef);
+    }
+    for (int i = 0; i < count; i++, xp++) {
+      int32_t sum = 0;
+      int k;
+      if (hp != NULL) {
+	if (flip)
+	  for (k = 0; k < m; k++) sum = mac(sum, hp[m - 1 - k], xp[k]);
+	else
+	  for (k = 0; k < m; k++) sum = mac(sum, hp[k], xp[k]);
+      }
+      else {
+	if (flip)
+	  for (k = 0; k < m; k++) sum = mac(sum, (int16_t) pgm_read_word(&pp[m - 1 - k]), xp[k]);
+	else
+	  for (k = 0; k < m; k++) sum = mac(sum, (int16_t) pgm_read_word(&pp[k]), xp[k]);
+      }
+      sum >>= shift;
+      yp[i] = sum > 32767 ? 32767 : (sum < -32768 ? -32768 : sum);
+    }
+    return (count);
+  }
+
+  /**
+   * Sift down given element in heap (cell array). The root is the
+   * largest element (max-heap) or the smallest (min-heap).
+   * @param[in] xp cell array.
+   * @param[in] i element index.
+   * @param[in] n number of elements in heap.
+   * @param[in] min min-heap (true) or max-heap (false).
+   */
+  static void sift(int* xp, int i, int n, bool min)
+  {
+    int v = xp[i];
+    for (int c; (c = 2 * i + 1) < n; i = c) {
+      if (c + 1 < n && (min ? xp[c + 1] < xp[c] : xp[c + 1] > xp[c])) c++;
+      if (!(min ? xp[c] < v : xp[c] > v)) break;
+      xp[i] = xp[c];
+    }
+    xp[i] = v;
+  }
+
+  /**
+   * In-place sort of given cell array in ascending order. Insertion
+   * sort for small arrays, otherwise heap sort; no recursion and no
+   * extra memory. Returns false if the array is out of bounds.
+   * @param[in] addr cell array.
+   * @param[in] n number of elements.
+   * @return bool.
+   */
+  bool sort(int addr, int n)
+  {
+    static const int INSERTION_MAX = 16;
+    int* xp = array(addr, n);
+    if (xp == NULL) return (false);
+    if (n <= INSERTION_MAX) {
+      for (int i = 1; i < n; i++) {
+	int v = xp[i];
+	int j = i;
+	for (; j > 0 && xp[j - 1] > v; j--) xp[j] = xp[j - 1];
+	xp[j] = v;
+      }
+      return (true);
+    }
+    for (int i = n / 2 - 1; i >= 0; i--) sift(xp, i, n, false);
+    for (int end = n - 1; end > 0; end--) {
+      int v = xp[0]; xp[0] = xp[end]; xp[end] = v;
+      sift(xp, 0, end, false);
+    }
+    return (true);
+  }
+
+  /**
+   * Partial selection; move the k largest elements of given cell array
+   * to the front in descending order. The order of the remaining
+   * elements is undefined. Min-heap of k elements, O(n log k). Returns
+   * false if the array is out of bounds or k is out of range.
+   * @param[in] addr cell array.
+   * @param[in] n number of elements.
+   * @param[in] k number of elements to select.
+   * @return bool.
+   */
+  bool top(int addr, int n, int k)
+  {
+    int* xp = array(addr, n);
+    if (xp == NULL || k < 0 || k > n) return (false);
+    for (int i = k / 2 - 1; i >= 0; i--) sift(xp, i, k, true);
+    for (int i = k; i < n; i++) {
+      if (k == 0 || xp[i] <= xp[0]) continue;
+      int v = xp[0]; xp[0] = xp[i]; xp[i] = v;
+      sift(xp, 0, k, true);
+    }
+    for (int end = k - 1; end > 0; end--) {
+      int v = xp[0]; xp[0] = xp[end]; xp[end] = v;
+      sift(xp, 0, end, true);
+    }
+    return (true);
+  }
+
+  /**
+   * Histogram of given cell array into m bins of given width, starting
+   * with given minimum value. The bins are cleared first. Elements
+   * outside the bins are not counted. Returns number of elements
+   * counted or negative error code.
+   * @param[in] dst bins cell array.
+   * @param[in] src cell array.
+   * @param[in] n number of elements.
+   * @param[in] min lower limit of first bin.
+   * @param[in] width of bins.
+   * @param[in] m number of bins.
+   * @return number of elements counted or negative error code.
+   */
+  int histogram(int dst, int src, int n, int min, int width, int m)
+  {
+    int* bins = array(dst, m);
+    const int* xp = array(src, n);
+    if (bins == NULL || xp == NULL || width < 1) return (-1);
+    int res = 0;
+    memset(bins, 0, m * sizeof(int));
+    for (int i = 0; i < n; i++) {
+      int32_t bin = ((int32_t) xp[i] - min);
+      if (bin < 0) continue;
+      bin /= width;
+      if (bin >= m) continue;
+      bins[bin] += 1;
+      res += 1;
+    }
+    return (res);
+  }
+
+  /**
+   * Find threshold crossings or local peaks in given cell array and
+   * write the element indices to the output array. An up-crossing is
+   * an element not less than the threshold after one that is less,
+   * and a down-crossing the opposite. A peak is an element not less
+   * than the threshold that is greater than the previous element and
+   * not less than the next (first element of a plateau). Stops when
+   * the output array is full. Returns number of indices or negative
+   * error code.
+   * @param[in] op operation code ('u', 'd' or 'p').
+   * @param[in] dst index cell array.
+   * @param[in] src cell array.
+   * @param[in] n number of elements.
+   * @param[in] threshold value.
+   * @param[in] max number of elements in index array.
+   * @return number of indices or negative error code.
+   */
+  int detect(char op, int dst, int src, int n, int threshold, int max)
+  {
+    int* ip = array(dst, max);
+    const int* xp = array(src, n);
+    if (ip == NULL || xp == NULL) return (-1);
+    int res = 0;
+    for (int i = 1; i < n && res < max; i++) {
+      bool found;
+      switch (op) {
+      case 'u':
+	found = (xp[i - 1] < threshold && xp[i] >= threshold);
+	break;
+      case 'd':
+	found = (xp[i - 1] >= threshold && xp[i] < threshold);
+	break;
+      default:
+	found = (i < n - 1
+		 && xp[i] >= threshold
+		 && xp[i] > xp[i - 1]
+		 && xp[i] >= xp[i + 1]);
+      }
+      if (found) ip[res++] = i;
+    }
+    return (res);
+  }
+
+  /**
+   * Return sine of given angle (256 steps per revolution) in
+   * fixed-point (Q15). Quarter wave table in program memory.
+   * @param[in] angle.
+   * @return sine.
+   */
+  static int sine(uint8_t angle)
+  {
+    static const int16_t quarter[65] PROGMEM = {
+      0, 804, 1608, 2410, 3212, 4011, 4808, 5602,
+      6393, 7179, 7962, 8739, 9512, 10278, 11039, 11793,
+      12539, 13279, 14010, 14732, 15446, 16151, 16846, 17530,
+      18204, 18868, 19519, 20159, 20787, 21403, 22005, 22594,
+      23170, 23731, 24279, 24811, 25329, 25832, 26319, 26790,
+      27245, 27683, 28105, 28510, 28898, 29268, 29621, 29956,
+      30273, 30571, 30852, 31113, 31356, 31580, 31785, 31971,
+      32137, 32285, 32412, 32521, 32609, 32678, 32728, 32757,
+      32767
+    };
+    uint8_t i = angle & 0x3f;
+    if (angle & 0x40) i = 64 - i;
+    int res = (int16_t) pgm_read_word(&quarter[i]);
+    return ((angle & 0x80) ? -res : res);
+  }
+
+  /**
+   * In-place radix-2 fast fourier transform of given complex cell
+   * arrays (real and imaginary part). Fixed-point (Q15) twiddle
+   * factors. Each stage is scaled by 1/2 to avoid overflow; the
+   * result is the transform divided by the number of elements.
+   * Returns false if the size is not a power of two within 16..256
+   * or the arrays are out of bounds.
+   * @param[in] re real part cell array.
+   * @param[in] im imaginary part cell array.
+   * @param[in] n number of elements.
+   * @return bool.
+   */
+  bool fft(int re, int im, int n)
+  {
+    int* xr = array(re, n);
+    int* xi = array(im, n);
+    if (n < 16 || n > 256 || (n & (n - 1)) || xr == NULL || xi == NULL)
+      return (false);
+
+    for (int i = 1, j = 0; i < n; i++) {
+      int bit = n >> 1;
+      for (; j & bit; bit >>= 1) j ^= bit;
+      j ^= bit;
+      if (i < j) {
+	int t = xr[i]; xr[i] = xr[j]; xr[j] = t;
+	t = xi[i]; xi[i] = xi[j]; xi[j] = t;
+      }
+    }
+    for (int len = 2; len <= n; len <<= 1) {
+      int half = len >> 1;
+      uint8_t step = 256 / len;
+      for (int k = 0; k < half; k++) {
+	uint8_t angle = k * step;
+	int32_t wr = sine(angle + 64);
+	int32_t wi = -sine(angle);
+	for (int i = k; i < n; i += len) {
+	  int j = i + half;
+	  int32_t tr = (wr * xr[j] - wi * xi[j]) >> 15;
+	  int32_t ti = (wr * xi[j] + wi * xr[j]) >> 15;
+	  int32_t ur = xr[i];
+	  int32_t ui = xi[i];
+	  xr[i] = (ur + tr) >> 1;
+	  xi[i] = (ui + ti) >> 1;
+	  xr[j] = (ur - tr) >> 1;
+	  xi[j] = (ui - ti) >> 1;
+	}
+      }
+    }
+    return (true);
+  }
+
+  /**
+   * Calculate magnitude of given complex cell arrays and store in the
+   * real part array. The squared sum is unsigned 32-bit (max 2^31),
+   * integer square root, saturated. Returns false if the arrays are
+   * out of bounds.
+   * @param[in] re real part cell array.
+   * @param[in] im imaginary part cell array.
+   * @param[in] n number of elements.
+   * @return bool.
+   */
+  bool magnitude(int re, int im, int n)
+  {
+    int* xr = array(re, n);
+    int* xi = array(im, n);
+    if (xr == NULL || xi == NULL) return (false);
+    for (int i = 0; i < n; i++) {
+      uint32_t v = (uint32_t) ((int32_t) xr[i] * xr[i])
+	+ (uint32_t) ((int32_t) xi[i] * xi[i]);
+      uint32_t res = 0;
+      for (uint32_t bit = 1UL << 30; bit != 0; bit >>= 2) {
+	if (v >= res + bit) {
+	  v -= res + bit;
+	  res = (res >> 1) + bit;
+	}
+	else
+	  res >>= 1;
+      }
+      xr[i] = res > 32767 ? 32767 : res;
+    }
+    return (true);
+  }
+
+  /**
+   * Calculate checksum over given cell array (variable address) or
+   * address range in any memory space (linear address). The low byte
+   * of each cell is used. Nibble table driven CRC-8 (polynomial 0x07),
+   * CRC-16/CCITT (polynomial 0x1021) and CRC-32 (reflected polynomial
+   * 0xedb88320 with complement, as zlib) and Fletcher-16. The given
+   * checksum is the initial value or result of a previous block.
+   * Returns false if the cell array is out of bounds.
+   * @param[in] op checksum operation code ('8', 'C', 'L' or 'F').
+   * @param[in] addr cell array or memory address.
+   * @param[in] n number of cells or bytes.
+   * @param[in,out] crc checksum.
+   * @return bool.
+   */
+  bool checksum(char op, int addr, int n, uint32_t& crc)
+  {
+    static const uint8_t crc8_tab[16] PROGMEM = {
+      0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15,
+      0x38, 0x3f, 0x36, 0x31, 0x24, 0x23, 0x2a, 0x2d
+    };
+    static const uint16_t crc16_tab[16] PROGMEM = {
+      0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+      0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef
+    };
+    static const uint32_t crc32_tab[16] PROGMEM = {
+      0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+      0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+      0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+      0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+    };
+    bool cells = (addr >= 0 && addr < (VAR_MAX + STACK_MAX));
+    if (n < 0 || (cells && addr + n > (VAR_MAX + STACK_MAX))) return (false);
+    Memory* mem = access((const char*) addr);
+    next_fn next = mem->get_next_fn();
+    const char* p = mem->as_local((const char*) addr);
+    uint16_t sum1 = crc & 0xff;
+    uint16_t sum2 = (crc >> 8) & 0xff;
+
+    if (op == 'L') crc = ~crc;
+    while (n--) {
+      uint8_t b = cells ? m_var[addr++] : next(p++);
+      switch (op) {
+      case '8':
+	crc = ((crc << 4) & 0xff) ^ pgm_read_byte(&crc8_tab[((crc >> 4) ^ (b >> 4)) & 0xf]);
+	crc = ((crc << 4) & 0xff) ^ pgm_read_byte(&crc8_tab[((crc >> 4) ^ b) & 0xf]);
+	break;
+      case 'C':
+	crc = ((crc << 4) & 0xffff) ^ pgm_read_word(&crc16_tab[((crc >> 12) ^ (b >> 4)) & 0xf]);
+	crc = ((crc << 4) & 0xffff) ^ pgm_read_word(&crc16_tab[((crc >> 12) ^ b) & 0xf]);
+	break;
+      case 'L':
+	crc = (crc >> 4) ^ pgm_read_dword(&crc32_tab[(crc ^ b) & 0xf]);
+	crc = (crc >> 4) ^ pgm_read_dword(&crc32_tab[(crc ^ (b >> 4)) & 0xf]);
+	break;
+      case 'F':
+	sum1 = (sum1 + b) % 255;
+	sum2 = (sum2 + sum1) % 255;
+	break;
+      }
+    }
+    if (op == 'L') crc = ~crc;
+    else if (op == 'F') crc = (sum2 << 8) | sum1;
+    return (true);
+  }
+
+  /**
+   * Return length of string literal at given linear address
+   * (terminated by double quote) or negative error code. Persistent
+   * literals (program memory and eeprom) are interned; repeated
+   * execution does not rescan the literal and equal literals are
+   * mapped to the same string address.
+   * @param[in,out] s string literal address, interned string address.
+   * @param[in] persistent literal may be added to string pool.
+   * @return length or negative error code.
+   */
+  int literal(const char* &s, bool persistent)
+  {
+    uint8_t i;
+
+    // Lookup literal in string pool
+    for (i = 0; i < m_strs; i++) {
+      if (m_str[i].addr == s) {
+	s = m_str[i].str;
+	return (m_str[i].len);
+      }
+    }
+
+    // Scan string literal
+    Memory* mem = access(s);
+    next_fn next = mem->get_next_fn();
+    const char* p = mem->as_local(s);
+    int len = 0;
+    char c;
+    while ((c = next(p++)) != '"') {
+      if (c == 0 || len == 255) return (-1);
+      len += 1;
+    }
+
+    // Intern; use string address of equal literal
+    const char* str = s;
+    for (i = 0; i < m_strs; i++) {
+      if (compare(m_str[i].str, m_str[i].len, s, len) == 0) {
+	str = m_str[i].str;
+	break;
+      }
+    }
+    if (persistent && m_strs < STR_MAX) {
+      m_str[m_strs].addr = s;
+      m_str[m_strs].str = str;
+      m_str[m_strs].len = len;
+      m_strs += 1;
+    }
+    s = str;
+    return (len);
+  }
+
+  /**
+   * Compare given strings (linear addresses in any memory space).
+   * Return negative, zero or positive value as string one is less
+   * than, equal to or greater than string two.
+   * @param[in] s1 first string address.
+   * @param[in] n1 first string length.
+   * @param[in] s2 second string address.
+   * @param[in] n2 second string length.
+   * @return -1, 0 or 1.
+   */
+  int compare(const char* s1, int n1, const char* s2, int n2)
+  {
+    if (s1 == s2 && n1 == n2) return (0);
+    Memory* m1 = access(s1);
+    Memory* m2 = access(s2);
+    next_fn next1 = m1->get_next_fn();
+    next_fn next2 = m2->get_next_fn();
+    const char* p1 = m1->as_local(s1);
+    const char* p2 = m2->as_local(s2);
+    for (int n = (n1 < n2 ? n1 : n2); n > 0; n--) {
+      char c1 = next1(p1++);
+      char c2 = next2(p2++);
+      if (c1 != c2) return (c1 < c2 ? -1 : 1);
+    }
+    return (n1 < n2 ? -1 : (n1 > n2 ? 1 : 0));
+  }
+
+  /**
+   * Write given string (linear address in any memory space) to output
+   * stream.
+   * @param[in] s string address.
+   * @param[in] n string length.
+   */
+  void type(const char* s, int n)
+  {
+    Memory* mem = access(s);
+    next_fn next = mem->get_next_fn();
+    const char* p = mem->as_local(s);
+    while (n-- > 0) m_ios.print(next(p++));
+  }
+
+  /**
+   * Write formatted output to output stream. The format string
+   * (linear address in any memory space) is scanned twice; first to
+   * count the arguments, as the first argument is the deepest on the
+   * parameter stack, and then to write the output in blocks. The
+   * arguments are dropped. Placeholders are %d (decimal), %u
+   * (unsigned), %x (hexadecimal), %c (character), %.Nf (fixed-point
+   * with N decimals), %s (string; address and length), %n (new line)
+   * and %% (percent). Decimal, hexadecimal and fixed-point values may
+   * have a field width with optional zero padding, e.g. %04x. Returns
+   * false if there are too few arguments on the stack.
+   * @param[in] s format string address.
+   * @param[in] n format string length.
+   * @return bool.
+   */
+  bool format(const char* s, int n)
+  {
+    Memory* mem = access(s);
+    next_fn next = mem->get_next_fn();
+    out_t out(m_ios);
+    int argc = 0;
+
+    // Count arguments in first pass and write output in second
+    for (uint8_t pass = 0; pass < 2; pass++) {
+      const char* p = mem->as_local(s);
+      const char* end = p + n;
+      int argv = argc;
+      while (p < end) {
+	char c = next(p++);
+	if (c != '%' || p == end) {
+	  if (pass) out.put(c);
+	  continue;
+	}
+
+	// Parse placeholder field width and precision
+	char pad = ' ';
+	int width = 0;
+	int prec = 0;
+	c = next(p++);
+	if (c == '0') pad = '0';
+	while (c >= '0' && c <= '9' && p < end) {
+	  width = (width * 10) + (c - '0');
+	  c = next(p++);
+	}
+	if (c == '.' && p < end) {
+	  c = next(p++);
+	  while (c >= '0' && c <= '9' && p < end) {
+	    prec = (prec * 10) + (c - '0');
+	    c = next(p++);
+	  }
+	}
+
+	// Count arguments or write placeholders without arguments
+	if (pass == 0) {
+	  if (c == 's') argc += 2;
+	  else if (c == 'd' || c == 'u' || c == 'x' || c == 'c' || c == 'f')
+	    argc += 1;
+	  continue;
+	}
+	if (c == 'n') {
+	  out.put('\r');
+	  out.put('\n');
+	  continue;
+	}
+	if (c != 'd' && c != 'u' && c != 'x' && c != 'c' && c != 'f' && c != 's') {
+	  out.put(c);
+	  continue;
+	}
+
+	// Fetch argument(s)
+	argv -= 1;
+	int w = (argv == 0) ? m_tos : m_sp[argv - 1];
+	if (c == 's') {
+	  argv -= 1;
+	  out.flush();
+	  type((const char*) w, (argv == 0) ? m_tos : m_sp[argv - 1]);
+	  continue;
+	}
+	if (c == 'c') {
+	  out.put(w);
+	  continue;
+	}
+
+	// Convert number to digits (in reverse order) and pad to width
+	char buf[16];
+	char* bp = buf + sizeof(buf);
+	unsigned long u = (unsigned) w;
+	bool neg = false;
+	uint8_t base = (c == 'x') ? 16 : 10;
+	if ((c == 'd' || c == 'f') && w < 0) {
+	  neg = true;
+	  u = -((long) w);
+	}
+	if (c != 'f') prec = 0;
+	else if (prec > 4) prec = 4;
+	int digits = 0;
+	do {
+	  uint8_t d = u % base;
+	  u = u / base;
+	  *--bp = (d < 10) ? '0' + d : 'a' + d - 10;
+	  if (++digits == prec) *--bp = '.';
+	} while (u != 0 || digits <= prec);
+	if (neg) {
+	  if (pad == '0') {
+	    out.put('-');
+	    width -= 1;
+	  }
+	  else *--bp = '-';
+	}
+	for (width -= (buf + sizeof(buf) - bp); width > 0; width--)
+	  out.put(pad);
+	while (bp < buf + sizeof(buf)) out.put(*bp++);
+      }
+      if (argc > depth()) return (false);
+    }
+    out.flush();
+
+    // Drop arguments
+    if (argc > 0) {
+      m_sp += argc - 1;
+      drop();
+    }
+    return (true);
+  }
+
+  /**
+   * Parse number in given string (linear address). Accepts the same
+   * format as literal numbers; optional sign and binary or hexadecimal
+   * prefix. Return true and assign value if successful otherwise false.
+   * @param[in] s string address.
+   * @param[in] n string length.
+   * @param[out] value parsed number.
+   * @return bool.
+   */
+  bool parse(const char* s, int n, int& value)
+  {
+    Memory* mem = access(s);
+    next_fn next = mem->get_next_fn();
+    const char* p = mem->as_local(s);
+    bool neg = false;
+    int base = 10;
+    int w = 0;
+    char c;
+
+    // Check for sign and base prefix
+    if (n > 0 && next(p) == '-') {
+      neg = true;
+      p += 1;
+      n -= 1;
+    }
+    if (n > 2 && next(p) == '0') {
+      c = next(p + 1);
+      if (c == 'x') base = 16;
+      else if (c == 'b') base = 2;
+      if (base != 10) {
+	p += 2;
+	n -= 2;
+      }
+    }
+    if (n <= 0) return (false);
+
+    // Convert digits
+    while (n--) {
+      c = next(p++);
+      if (!is_digit(c, base)) return (false);
+      if (base == 16 && c >= 'a')
+	w = (w * base) + (c - 'a') + 10;
+      else
+	w = (w * base) + (c - '0');
+    }
+    value = (neg ? -w : w);
+    return (true);
+  }
+
+  /**
+   * Return threaded code for given script (linear address) or NULL.
+   * Each arena block has a header with the script address and the
+   * block size (cells).
+   * @param[in] script address.
+   * @return threaded code or NULL.
+   */
+  const int* threaded(const char* script)
+  {
+    for (int i = 0; i < m_ap; i += m_arena[i + 1])
+      if (m_arena[i] == (int) script) return (&m_arena[i + 2]);
+    return (NULL);
+  }
+
+  /**
+   * Translate given script (linear address in eeprom or program
+   * memory) to threaded code in the arena. Returns true if the script
+   * is threaded otherwise false (script in data memory, arena full or
+   * extended instructions).
+   * @param[in] script address.
+   * @return bool.
+   */
+  bool thread(const char* script)
+  {
+    Memory* mem = access(script);
+    if (ARENA_MAX == 0 || mem == &m_memory || script == NULL) return (false);
+    if (threaded(script) != NULL) return (true);
+    const void* const* handler;
+    run(NULL, NULL, &handler);
+    reclaim();
+    int start = m_ap;
+    m_ap += 2;
+    if (translate(mem, mem->as_local(script), handler, start + 2, 0, false) == NULL
+	|| m_ap > ARENA_MAX) {
+      m_ap = start;
+      return (false);
+    }
+    m_arena[start] = (int) script;
+    m_arena[start + 1] = m_ap - start;
+    return (true);
+  }
+
+  /**
+   * Remove threaded code for given script. The block is marked as
+   * released and reclaimed when no threaded code is running.
+   * @param[in] script address.
+   */
+  void unthread(const char* script)
+  {
+    const int* code = threaded(script);
+    if (code == NULL) return;
+    m_arena[code - m_arena - 2] = 0;
+    reclaim();
+  }
+
+  /**
+   * Remove all threaded code and restart counting calls. Names are
+   * bound when translated; called when the dictionary or the search
+   * order changes so that names resolve as in the interpreter.
+   */
+  void unthread()
+  {
+    for (int k = 0; k < m_ap; k += m_arena[k + 1]) m_arena[k] = 0;
+    reclaim();
+    if (ARENA_MAX > 0) memset(m_count, 0, sizeof(m_count));
+  }
+
+  /**
+   * Compact the arena by removing released blocks (script address
+   * zero). Jump offsets are relative to the code so blocks may be
+   * moved, but not while threaded code is running.
+   */
+  void reclaim()
+  {
+    if (m_runs != 0) return;
+    int i = 0;
+    while (i < m_ap) {
+      int n = m_arena[i + 1];
+      if (m_arena[i] != 0) {
+	i += n;
+	continue;
+      }
+      memmove(&m_arena[i], &m_arena[i + n], (m_ap - i - n) * sizeof(int));
+      m_ap -= n;
+    }
+  }
+
+  /**
+   * Append given value to the arena. The arena pointer is advanced
+   * also when full so that the translation can be checked when done.
+   * @param[in] value to append.
+   */
+  void emit(int value)
+  {
+    if (m_ap < ARENA_MAX) m_arena[m_ap] = value;
+    m_ap += 1;
+  }
+
+  /**
+   * Set jump offset at given arena position to the arena pointer.
+   * @param[in] at arena position of offset.
+   * @param[in] code arena position of code.
+   */
+  void patch(int at, int code)
+  {
+    if (at < ARENA_MAX) m_arena[at] = m_ap - code;
+  }
+
+  /**
+   * Return position after end of block (matching right brace) starting
+   * at given position, or NULL if not terminated.
+   * @param[in] next read function.
+   * @param[in] ip local block address (after left brace).
+   * @return local address or NULL.
+   */
+  const char* extent(next_fn next, const char* ip)
+  {
+    int n = 1;
+    char op;
+    while (n != 0 && (op = next(ip++)) != 0) {
+      if (op == '{') n++;
+      else if (op == '}') n--;
+    }
+    return (n == 0 ? ip : NULL);
+  }
+
+  /**
+   * Translate script or block to threaded code. Operations with
+   * handlers are translated directly, blocks followed by control
+   * structure operations (if, if-else, while, loop and execute) are
+   * translated inline to jumps and names are bound when translated.
+   * Names are not added to the dictionary; a script with a name that
+   * is not defined is not threaded. Other operations are interpreted
+   * one at a time. Returns position after script or block, or NULL if
+   * the script cannot be threaded.
+   * @param[in] mem memory access.
+   * @param[in] ip local script address.
+   * @param[in] handler handler table.
+   * @param[in] code arena position of code (jump offset origin).
+   * @param[in] loops loop nesting.
+   * @param[in] block translate block (until end of block).
+   * @return local address or NULL.
+   */
+  const char* translate(Memory* mem, const char* ip, const void* const* handler,
+			int code, uint8_t loops, bool block)
+  {
+    static const char ops[] PROGMEM = "n+-*/%h=#<>~&|^cdgjoprsqu@!\\$.mv";
+    next_fn next = mem->get_next_fn();
+    bool neg = false;
+    int base = 10;
+    int w, at;
+    char op;
+
+    while ((op = next(ip++)) != 0) {
+
+      // Literal numbers; same syntax as execute()
+      if (op == '-') {
+	op = next(ip);
+	if (op < '0' || op > '9') {
+	  op = '-';
+	}
+	else {
+	  neg = true;
+	  ip += 1;
+	}
+      }
+      else if (op == '0') {
+	op = next(ip++);
+	if (op == 'x') base = 16;
+	else if (op == 'b') base = 2;
+	else ip -= 2;
+	op = next(ip++);
+      }
+      if (is_digit(op, base)) {
+	w = 0;
+	do {
+	  if (base == 16 && op >= 'a')
+	    w = (w * base) + (op - 'a') + 10;
+	  else
+	    w = (w * base) + (op - '0');
+	  op = next(ip++);
+	} while (is_digit(op, base));
+	if (neg) {
+	  w = -w;
+	  neg = false;
+	}
+	emit((int) handler[OP_LIT]);
+	emit(w);
+	base = 10;
+	if (op == 0) break;
+      }
+
+      // Operations in disabled instruction subsets are interpreted (fail)
+      if ((!(FEATURES & SHELL_FRAMES) && (op == '\\' || op == '$'))
+	  || (!(FEATURES & SHELL_OUTPUT)
+	      && (op == '(' || op == '.' || op == '?' || op == 'm' || op == 'v'))
+	  || (!(FEATURES & SHELL_DICTIONARY) && op == ';')) {
+	emit((int) handler[OP_INTERPRET]);
+	emit(op);
+	continue;
+      }
+
+      // Operations with handlers
+      for (w = 0; (at = pgm_read_byte(&ops[w])) != 0; w++)
+	if (at == op) break;
+      if (at != 0) {
+	emit((int) handler[OP_NEG + w]);
+	continue;
+      }
+
+      // Special forms and operations that are interpreted
+      switch (op) {
+      case ' ':
+      case ',':
+      case '\n':
+      case 'N':
+	continue;
+      case 'F':
+      case 'T':
+	emit((int) handler[OP_LIT]);
+	emit(op == 'T' ? -1 : 0);
+	continue;
+      case '?':
+	emit((int) handler[OP_FETCH]);
+	emit((int) handler[OP_DOT]);
+	continue;
+      case '\'':
+	op = next(ip);
+	if (op != 0) {
+	  emit((int) handler[OP_LIT]);
+	  emit(op);
+	  ip += 1;
+	}
+	continue;
+      case '"':
+	{
+	  const char* sp = mem->as_addr(ip);
+	  w = literal(sp, true);
+	  if (w < 0) return (NULL);
+	  ip += w + 1;
+	  emit((int) handler[OP_STR]);
+	  emit((int) sp);
+	  emit(w);
+	}
+	continue;
+      case '(':
+	{
+	  const char* sp = ip;
+	  w = 1;
+	  while (w != 0 && (op = next(ip++)) != 0) {
+	    if (op == '(') w++;
+	    else if (op == ')') w--;
+	  }
+	  if (op == 0) return (NULL);
+	  emit((int) handler[OP_TYPE]);
+	  emit((int) mem->as_addr(sp));
+	  emit(ip - sp - 1);
+	}
+	continue;
+      case ':':
+      case '`':
+	{
+	  char name[NAME_MAX];
+	  size_t len = 0;
+	  bool flag = (op == ':');
+	  op = next(ip);
+	  if (!isalpha(op)) return (NULL);
+	  name[len++] = op;
+	  while (((op = next(++ip)) != 0) && isalnum(op) && len < NAME_MAX - 1)
+	    name[len++] = op;
+	  if (isalnum(op)) return (NULL);
+	  name[len] = 0;
+
+	  // Bind existing entries only; interpret script otherwise
+	  w = lookup(name, len, false);
+	  if (w < 0 || (flag && w >= DICT_MAX)) return (NULL);
+	  emit((int) handler[flag ? OP_VAR : OP_CALL]);
+	  emit(w);
+	}
+	continue;
+      case '{':
+	{
+	  // Check for control structure operation after block(s)
+	  const char* end = extent(next, ip);
+	  if (end == NULL) return (NULL);
+	  const char* sp = end;
+	  const char* other = NULL;
+	  while ((op = next(sp)) == ' ' || op == ',') sp++;
+	  if (op == '{') {
+	    other = sp + 1;
+	    sp = extent(next, other);
+	    if (sp == NULL) return (NULL);
+	    while ((op = next(sp)) == ' ' || op == ',') sp++;
+	    if (op != 'e') op = 0;
+	  }
+	  switch (op) {
+	  case 'e':
+	    emit((int) handler[OP_JZ]);
+	    at = m_ap;
+	    emit(0);
+	    if (translate(mem, ip, handler, code, loops, true) == NULL) return (NULL);
+	    emit((int) handler[OP_JMP]);
+	    w = m_ap;
+	    emit(0);
+	    patch(at, code);
+	    if (translate(mem, other, handler, code, loops, true) == NULL) return (NULL);
+	    patch(w, code);
+	    break;
+	  case 'i':
+	    emit((int) handler[OP_JZ]);
+	    at = m_ap;
+	    emit(0);
+	    if (translate(mem, ip, handler, code, loops, true) == NULL) return (NULL);
+	    patch(at, code);
+	    break;
+	  case 'l':
+	    if (loops == LOOP_MAX) return (NULL);
+	    emit((int) handler[OP_LOOP]);
+	    at = m_ap;
+	    emit(0);
+	    if (translate(mem, ip, handler, code, loops + 1, true) == NULL) return (NULL);
+	    emit((int) handler[OP_NEXT]);
+	    emit(at + 1 - code);
+	    patch(at, code);
+	    break;
+	  case 'w':
+	    at = m_ap;
+	    if (translate(mem, ip, handler, code, loops, true) == NULL) return (NULL);
+	    emit((int) handler[OP_JNZ]);
+	    emit(at - code);
+	    break;
+	  case 'x':
+	    if (translate(mem, ip, handler, code, loops, true) == NULL) return (NULL);
+	    break;
+	  default:
+	    emit((int) handler[OP_BLOCK]);
+	    emit((int) mem->as_addr(ip));
+	    emit(end - ip - 1);
+	    ip = end;
+	    continue;
+	  }
+	  ip = sp + 1;
+	}
+	continue;
+      case '}':
+	if (!block) emit((int) handler[OP_END]);
+	return (ip);
+      case ';':
+	emit((int) handler[OP_DEFINE]);
+	continue;
+      case TRAP_OP_CODE:
+	return (NULL);
+      case 'B':
+      case 'G':
+      case 'J':
+      case 'Q':
+      case 'V':
+	w = next(ip++);
+	if (w == 0) return (NULL);
+	emit((int) handler[OP_INTERPRET]);
+	emit(op | (w << 8));
+	continue;
+      default:
+	emit((int) handler[OP_INTERPRET]);
+	emit(op);
+	continue;
+      }
+    }
+    if (block) return (NULL);
+    emit((int) handler[OP_EXIT]);
+    return (ip);
+  }
+
+  /**
+   * Run threaded code; each handler ends with a jump to the next
+   * handler address in the code (direct threading with computed goto,
+   * GCC). Returns true if successful otherwise false. Called with
+   * table reference to get the handler table.
+   * @param[in] script address (error position).
+   * @param[in] code threaded code.
+   * @param[out] table handler table (default NULL).
+   * @return bool.
+   */
+  bool run(const char* script, const int* code, const void* const** table = NULL)
+  {
+    static const void* const handler[] = {
+      &&op_exit, &&op_end, &&op_lit, &&op_jmp, &&op_jz, &&op_jnz,
+      &&op_loop, &&op_next, &&op_var, &&op_call, &&op_type, &&op_str,
+      &&op_block, &&op_define, &&op_interpret,
+      &&op_neg, &&op_add, &&op_sub, &&op_mul, &&op_div, &&op_mod,
+      &&op_scale, &&op_eq, &&op_ne, &&op_lt, &&op_gt, &&op_not,
+      &&op_and, &&op_or, &&op_xor, &&op_ndrop, &&op_drop, &&op_roll,
+      &&op_depth, &&op_over, &&op_pick, &&op_rot, &&op_swap, &&op_qdup,
+      &&op_dup, &&op_fetch, &&op_store, &&op_frame, &&op_frame_addr,
+      &&op_dot, &&op_cr, &&op_emit
+    };
+    if (table != NULL) {
+      *table = handler;
+      return (true);
+    }
+    const int* ip = code;
+    int* fp = m_fp;
+    int loop[LOOP_MAX * 2];
+    int* lp = loop;
+    size_t len = 0;
+    const char* sp;
+    const char* tp;
+    int w, n;
+    char buf[3];
+
+#define NEXT() goto *(void*) *ip++
+    NEXT();
+  op_exit:
+    m_fp = fp;
+  op_end:
+    return (true);
+  op_lit:
+    push(*ip++);
+    NEXT();
+  op_jmp:
+    ip = code + *ip;
+    NEXT();
+  op_jz:
+    if (pop() == 0) ip = code + *ip; else ip++;
+    NEXT();
+  op_jnz:
+    if (++m_ticks == 0) tick(script);
+    if (pop() != 0) ip = code + *ip; else ip++;
+    NEXT();
+  op_loop:
+    n = pop();
+    w = pop();
+    if (w > n) {
+      ip = code + *ip;
+      NEXT();
+    }
+    ip++;
+    lp[0] = w;
+    lp[1] = n;
+    lp += 2;
+    push(w);
+    NEXT();
+  op_next:
+    if (++m_ticks == 0) tick(script);
+    if (lp[-2] < lp[-1]) {
+      push(++lp[-2]);
+      ip = code + *ip;
+      NEXT();
+    }
+    lp -= 2;
+    ip++;
+    NEXT();
+  op_var:
+    w = *ip++;
+    push(w < DICT_MAX ? address(w) : (w - DICT_MAX) + 0x4000);
+    NEXT();
+  op_call:
+    if (++m_ticks == 0) tick(script);
+    if (!call(*ip++)) return (false);
+    NEXT();
+  op_type:
+    type((const char*) ip[0], ip[1]);
+    ip += 2;
+    NEXT();
+  op_str:
+    push(ip[0]);
+    push(ip[1]);
+    ip += 2;
+    NEXT();
+  op_block:
+    push(ip[0]);
+    len = ip[1];
+    ip += 2;
+    NEXT();
+  op_define:
+    w = pop();
+    if (!copy(pop(), (const char*) w, len)) return (false);
+    NEXT();
+  op_interpret:
+    w = *ip++;
+    buf[0] = w;
+    buf[1] = w >> 8;
+    buf[2] = 0;
+    sp = m_step;
+    tp = m_thread;
+    m_step = buf;
+    m_thread = script;
+    interpret(buf);
+    m_step = sp;
+    m_thread = tp;
+    NEXT();
+  op_neg:
+    tos(-tos());
+    NEXT();
+  op_add:
+    w = pop();
+    tos(tos() + w);
+    NEXT();
+  op_sub:
+    w = pop();
+    tos(tos() - w);
+    NEXT();
+  op_mul:
+    w = pop();
+    tos(tos() * w);
+    NEXT();
+  op_div:
+    w = pop();
+    tos(tos() / w);
+    NEXT();
+  op_mod:
+    w = pop();
+    tos(tos() % w);
+    NEXT();
+  op_scale:
+    w = pop();
+    n = pop();
+    tos(tos() * ((long) n) / w);
+    NEXT();
+  op_eq:
+    w = pop();
+    tos(as_bool(tos() == w));
+    NEXT();
+  op_ne:
+    w = pop();
+    tos(as_bool(tos() != w));
+    NEXT();
+  op_lt:
+    w = pop();
+    tos(as_bool(tos() < w));
+    NEXT();
+  op_gt:
+    w = pop();
+    tos(as_bool(tos() > w));
+    NEXT();
+  op_not:
+    tos(~tos());
+    NEXT();
+  op_and:
+    w = pop();
+    tos(tos() & w);
+    NEXT();
+  op_or:
+    w = pop();
+    tos(tos() | w);
+    NEXT();
+  op_xor:
+    w = pop();
+    tos(tos() ^ w);
+    NEXT();
+  op_ndrop:
+    n = tos();
+    if (n > 0 && n < depth()) m_sp += n;
+  op_drop:
+    drop();
+    NEXT();
+  op_roll:
+    n = tos();
+    if (n > 0 && n < depth()) {
+      tos(m_sp[--n]);
+      for (; n > 0; n--)
+	m_sp[n] = m_sp[n - 1];
+      m_sp += 1;
+    }
+    else drop();
+    NEXT();
+  op_depth:
+    push(depth());
+    NEXT();
+  op_over:
+    push(*m_sp);
+    NEXT();
+  op_pick:
+    tos(*(m_sp + tos() - 1));
+    NEXT();
+  op_rot:
+    w = tos();
+    tos(*(m_sp + 1));
+    *(m_sp + 1) = *m_sp;
+    *m_sp = w;
+    NEXT();
+  op_swap:
+    w = tos();
+    tos(*m_sp);
+    *m_sp = w;
+    NEXT();
+  op_qdup:
+    if (tos() == 0) NEXT();
+  op_dup:
+    push(tos());
+    NEXT();
+  op_fetch:
+    tos(read(tos()));
+    NEXT();
+  op_store:
+    n = pop();
+    w = pop();
+    write(n, w);
+    NEXT();
+  op_frame:
+    n = pop();
+    if (n > 0) {
+      m_fp = m_sp + n - 1;
+    }
+    else {
+      n = m_fp - m_sp + n;
+      if (n >= 0) {
+	while (n--) *--m_fp = m_sp[n];
+	m_sp = m_fp;
+      }
+      else {
+	m_sp = m_fp;
+	drop();
+      }
+    }
+    NEXT();
+  op_frame_addr:
+    n = tos();
+    tos((m_fp - n) - m_var);
+    NEXT();
+  op_dot:
+    w = pop();
+    if (m_base == 2) m_ios.print(F("0b"));
+    else if (m_base == 8) m_ios.print(F("0"));
+    else if (m_base == 16) m_ios.print(F("0x"));
+    m_ios.print(w, m_base > 0 ? m_base : -m_base);
+    m_ios.print(' ');
+    NEXT();
+  op_cr:
+    m_ios.println();
+    NEXT();
+  op_emit:
+    w = pop();
+    m_ios.write(w);
+    NEXT();
+#undef NEXT
+  }
 };
 
 #endif
@@ -0,0 +1,80 @@
+/**
+ * @file ShellQueue.ino
+ * @version 1.0
+ *
+ * @section License
+ * Copyright (C) 2016, Mikael Patel
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * @section Description
+ * This Arduino sketch shows how to use a Shell queue between an
+ * interrupt handler (producer) and the loop (consumer). The handler
+ * puts a sequence number for each rising edge on the interrupt pin.
+ * The loop gets the elements and checks that they are in order; the
+ * number of lost elements should be the same as the queue overflow
+ * count. Connect the PWM pin to the interrupt pin for a stress test.
+ */
+
+#include <Shell.h>
+
+Shell<16,32> shell(Serial);
+
+const int INTERRUPT_PIN = 2;
+const int PWM_PIN = 3;
+
+int queue;
+volatile unsigned int seq = 0;
+unsigned int expected = 0;
+unsigned long received = 0;
+unsigned long lost = 0;
+unsigned long timestamp = 0;
+
+void producer()
+{
+  shell.enqueue(queue, seq++);
+}
+
+void setup()
+{
+  Serial.begin(57600);
+  while (!Serial);
+  Serial.println(F("ShellQueue: started"));
+
+  // Queue with capacity 16 in a cell array; header of four cells
+  shell.execute(F(":q,20Va :q,16Qi :q"));
+  queue = shell.pop();
+
+  // Start the producer after the queue has been initiated
+  pinMode(INTERRUPT_PIN, INPUT_PULLUP);
+  attachInterrupt(digitalPinToInterrupt(INTERRUPT_PIN), producer, RISING);
+  analogWrite(PWM_PIN, 128);
+}
+
+void loop()
+{
+  // Get all elements; gaps in the sequence are overflows
+  int value;
+  while (shell.dequeue(queue, value)) {
+    lost += (unsigned int) value - expected;
+    expected = value + 1;
+    received += 1;
+  }
+
+  // Print statistics every second; overflow count with a script
+  if (millis() - timestamp < 1000) return;
+  timestamp = millis();
+  Serial.print(F("received="));
+  Serial.print(received);
+  Serial.print(F(", lost="));
+  Serial.print(lost);
+  shell.execute(F("(, overflows=):qQo.m"));
+}
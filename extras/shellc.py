@@ -0,0 +1,576 @@
+#!/usr/bin/env python3
+#
+# @file shellc.py
+# @version 1.0
+#
+# @section License
+# Copyright (C) 2016, Mikael Patel
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# @section Description
+# Ahead-of-time compiler for Shell scripts. Translates application
+# scripts, SCRIPT(name, "code") definitions or dictionary lines in
+# the form :name{code}; to C++. The result is a header file with the
+# script definitions, the script table and a Shell sub-class with a
+# member function per script. The sub-class overrides Shell::native()
+# so that the compiled code is used when the script is called with
+# `name. The member functions use the same stack primitives as
+# Shell::execute(). Blocks used with the control structure operations
+# (i, e, w, l and x) are compiled inline; a control structure
+# operation on a block address from the stack (e.g. a variable) is
+# executed by the interpreter. Operations that are not translated
+# directly (string, system, queue and vector operations) are executed
+# by the interpreter one at a time.
+# Scripts with extended instructions (trap) are not compiled and are
+# interpreted as before.
+#
+# Calls to other compiled scripts are bound at compile time. Compiled
+# operations are counted as the interpreter counts them, once per
+# operation, and the execution limits are checked before calls and at
+# the end of each block (loop iteration). The member function check() runs a script with the
+# interpreter and with the compiled scripts and compares the results.
+#
+# Usage: shellc.py [-b BASE] [-c CLASS] FILE... > FILE.h
+#
+
+import argparse
+import re
+import sys
+
+
+class Unsupported(Exception):
+    pass
+
+
+# Operations translated directly; same code as Shell::execute()
+OPS = {
+    'n': ["tos(-tos());"],
+    '+': ["w = pop();", "tos(tos() + w);"],
+    '-': ["w = pop();", "tos(tos() - w);"],
+    '*': ["w = pop();", "tos(tos() * w);"],
+    '/': ["w = pop();", "tos(tos() / w);"],
+    '%': ["w = pop();", "tos(tos() % w);"],
+    'h': ["w = pop();", "n = pop();", "tos(tos() * ((long) n) / w);"],
+    'F': ["push(0);"],
+    'T': ["push(-1);"],
+    '=': ["w = pop();", "tos(as_bool(tos() == w));"],
+    '#': ["w = pop();", "tos(as_bool(tos() != w));"],
+    '<': ["w = pop();", "tos(as_bool(tos() < w));"],
+    '>': ["w = pop();", "tos(as_bool(tos() > w));"],
+    '~': ["tos(~tos());"],
+    '&': ["w = pop();", "tos(tos() & w);"],
+    '|': ["w = pop();", "tos(tos() | w);"],
+    '^': ["w = pop();", "tos(tos() ^ w);"],
+    'c': ["n = tos();", "if (n > 0 && n < depth()) m_sp += n;", "drop();"],
+    'd': ["drop();"],
+    'g': ["n = tos();",
+          "if (n > 0 && n < depth()) {",
+          "  tos(m_sp[--n]);",
+          "  for (; n > 0; n--) m_sp[n] = m_sp[n - 1];",
+          "  m_sp += 1;",
+          "}",
+          "else drop();"],
+    'j': ["push(depth());"],
+    'o': ["push(*m_sp);"],
+    'p': ["tos(*(m_sp + tos() - 1));"],
+    'r': ["w = tos();", "tos(*(m_sp + 1));",
+          "*(m_sp + 1) = *m_sp;", "*m_sp = w;"],
+    's': ["w = tos();", "tos(*m_sp);", "*m_sp = w;"],
+    'q': ["if (tos() != 0) push(tos());"],
+    'u': ["push(tos());"],
+    '@': ["tos(read(tos()));"],
+    '!': ["addr = pop();", "w = pop();", "write(addr, w);"],
+    '\\': ["n = pop();",
+           "if (n > 0) {",
+           "  m_fp = m_sp + n - 1;",
+           "}",
+           "else {",
+           "  n = m_fp - m_sp + n;",
+           "  if (n >= 0) {",
+           "    while (n--) *--m_fp = m_sp[n];",
+           "    m_sp = m_fp;",
+           "  }",
+           "  else {",
+           "    m_sp = m_fp;",
+           "    drop();",
+           "  }",
+           "}"],
+    '$': ["n = tos();", "tos((m_fp - n) - m_var);"],
+    'k': ["while ((w = m_ios.read()) < 0) idle(NO_DEADLINE);", "push(w);"],
+    'b': ["m_base = pop();"],
+    '.': ["w = pop();",
+          "if (m_base == 2) m_ios.print(F(\"0b\"));",
+          "else if (m_base == 8) m_ios.print(F(\"0\"));",
+          "else if (m_base == 16) m_ios.print(F(\"0x\"));",
+          "m_ios.print(w, m_base > 0 ? m_base : -m_base);",
+          "m_ios.print(' ');"],
+    'm': ["m_ios.println();"],
+    'v': ["w = pop();", "m_ios.write(w);"],
+    'y': ["yield();"],
+    'A': ["pin = tos();", "tos(analogRead(pin));"],
+    'C': ["clear();"],
+    'H': ["pin = pop();", "digitalWrite(pin, HIGH);"],
+    'I': ["pin = pop();", "pinMode(pin, INPUT);"],
+    'L': ["pin = pop();", "digitalWrite(pin, LOW);"],
+    'M': ["push(millis());"],
+    'O': ["pin = pop();", "pinMode(pin, OUTPUT);"],
+    'P': ["pin = pop();", "w = pop();", "analogWrite(pin, w);"],
+    'R': ["pin = tos();", "tos(as_bool(digitalRead(pin)));"],
+    'S': ["print();"],
+    'U': ["pin = pop();", "pinMode(pin, INPUT_PULLUP);"],
+    'W': ["pin = pop();", "w = pop();", "digitalWrite(pin, w);"],
+    'X': ["pin = pop();", "digitalWrite(pin, !digitalRead(pin));"],
+    'Y': ["words();"],
+    '[': ["if (m_marker == -1) m_marker = depth();"],
+    ']': ["if (m_marker == -1) return (false);",
+          "push(depth() - m_marker);",
+          "m_marker = -1;"],
+    ';': ["sp = (const char*) pop();",
+          "if (!copy(pop(), sp, len)) return (false);"],
+}
+OPS['Bl'] = ["n = pop();",
+             "tos((n < 0 || n >= CELL_BITS) ? 0 : (int) ((unsigned) tos() << n));"]
+OPS['Br'] = ["n = pop();",
+             "tos((n < 0 || n >= CELL_BITS) ? 0 : (int) ((unsigned) tos() >> n));"]
+OPS['Ba'] = ["n = pop();",
+             "if (n < 0) n = 0;",
+             "else if (n >= CELL_BITS) n = CELL_BITS - 1;",
+             "tos(tos() >> n);"]
+OPS['Bo'] = ["n = pop() & (CELL_BITS - 1);",
+             "if (n != 0)",
+             "  tos((int) (((unsigned) tos() << n) | ((unsigned) tos() >> (CELL_BITS - n))));"]
+OPS['Bc'] = ["tos(__builtin_popcount((unsigned) tos()));"]
+OPS['Bz'] = ["tos(tos() == 0 ? CELL_BITS : __builtin_clz((unsigned) tos()));"]
+OPS['Bx'] = ["w = pop();",
+             "n = pop();",
+             "if (n < 0 || n >= CELL_BITS || w <= 0) tos(0);",
+             "else {",
+             "  tos((unsigned) tos() >> n);",
+             "  if (w < CELL_BITS) tos(tos() & ((1U << w) - 1));",
+             "}"]
+OPS['Bi'] = ["w = pop();",
+             "n = pop();",
+             "addr = pop();",
+             "if (n >= 0 && n < CELL_BITS && w > 0) {",
+             "  unsigned mask = (w < CELL_BITS) ? ((1U << w) - 1) : ~0U;",
+             "  mask = mask << n;",
+             "  tos((int) (((unsigned) tos() & ~mask) | (((unsigned) addr << n) & mask)));",
+             "}"]
+OPS['?'] = ["tos(read(tos()));"] + OPS['.']
+OPS['D'] = ["{",
+            "  unsigned long start = millis();",
+            "  unsigned long ms = (unsigned) pop();",
+            "  unsigned long elapsed;",
+            "  while ((elapsed = millis() - start) < ms) idle(ms - elapsed);",
+            "}"]
+OPS['E'] = ["addr = pop();",
+            "w = read(addr);",
+            "n = tos();",
+            "if ((((unsigned) millis() & 0xffff) - ((unsigned) w)) >= ((unsigned) n)) {",
+            "  tos(-1);",
+            "  write(addr, millis());",
+            "}",
+            "else tos(0);"]
+
+# Operations executed by the interpreter (do not read further script)
+SINGLE = "afztKZ"
+PREFIX = "BGJQV"
+NOOPS = " ,\nN"
+
+# Control structure operations; executed by the interpreter when not
+# after a block
+CONTROL = "iewlx"
+
+
+def c_string(s):
+    """Return C string literal for given string."""
+    return '"' + s.replace('\\', '\\\\').replace('"', '\\"').replace('\n', '\\n') + '"'
+
+
+def is_digit(c, base):
+    if base == 2:
+        return c in "01"
+    if base == 16 and c >= 'a':
+        return 'a' <= c <= 'f'
+    return '0' <= c <= '9'
+
+
+class Compiler:
+    """Script to C++ statement compiler; words is the set of compiled
+    script names."""
+
+    def __init__(self, words):
+        self.words = words
+        self.count = 0
+
+    def extent(self, code, i):
+        """Return index after block starting at code[i] (after left brace),
+        as the interpreter scans it, or None if not terminated."""
+        n = 1
+        while n != 0 and i < len(code):
+            if code[i] == '{':
+                n += 1
+            elif code[i] == '}':
+                n -= 1
+            i += 1
+        return i if n == 0 else None
+
+    def skip(self, code, i):
+        while i < len(code) and code[i] in " ,":
+            i += 1
+        return i
+
+    def compile(self, name, code, i=0, top=True):
+        """Compile code from index i until end (or end of block).
+        Return list of statements."""
+        out = []
+        base = 10
+        neg = False
+        after_number = False
+        while i < len(code):
+            c = code[i]
+            i += 1
+            # Check for negative number and base prefix
+            if not after_number:
+                if c == '-' and i < len(code) and '0' <= code[i] <= '9':
+                    neg = True
+                    c = code[i]
+                    i += 1
+                elif c == '0' and i < len(code) and code[i] in "xb":
+                    base = 16 if code[i] == 'x' else 2
+                    c = code[i + 1] if i + 1 < len(code) else '\0'
+                    i += 2
+            # Check for literal number; following character is an operation
+            if not after_number and is_digit(c, base):
+                w = 0
+                while is_digit(c, base):
+                    if base == 16 and c >= 'a':
+                        w = w * base + ord(c) - ord('a') + 10
+                    else:
+                        w = w * base + ord(c) - ord('0')
+                    c = code[i] if i < len(code) else '\0'
+                    i += 1
+                out.append("push(%d);" % (-w if neg else w))
+                neg = False
+                base = 10
+                if c == '\0':
+                    self.count += 1
+                    break
+                i -= 1
+                after_number = True
+                continue
+            after_number = False
+            if c == '\0':
+                break
+            if c in NOOPS:
+                self.count += 1
+                continue
+            if c in OPS:
+                self.count += 1
+                out += OPS[c]
+                continue
+            if c in SINGLE or c in CONTROL:
+                out.append("if (execute(F(%s)) != NULL) return (false);" % c_string(c))
+                continue
+            if c in PREFIX:
+                if i >= len(code):
+                    out.append("return (false);")
+                    break
+                op = code[i - 1:i + 1]
+                if op in OPS:
+                    self.count += 1
+                    out += OPS[op]
+                else:
+                    out.append("if (execute(F(%s)) != NULL) return (false);"
+                               % c_string(op))
+                i += 1
+                continue
+            if c == '}':
+                self.count += 1
+                out += self.flush(name, i - 1)
+                if top:
+                    out.append("return (true);")
+                return out
+            if c == '\'':
+                self.count += 1
+                if i < len(code):
+                    out.append("push(%d);" % ord(code[i]))
+                    i += 1
+                continue
+            if c == '(':
+                j = i
+                n = 1
+                text = ""
+                while n != 0 and j < len(code):
+                    if code[j] == '(':
+                        n += 1
+                    elif code[j] == ')':
+                        n -= 1
+                    if n > 0:
+                        text += code[j]
+                    j += 1
+                self.count += 1
+                if text:
+                    out.append("m_ios.print(F(%s));" % c_string(text))
+                if n != 0:
+                    out.append("return (false);")
+                    break
+                i = j
+                continue
+            if c == '"':
+                j = code.find('"', i)
+                if j < 0:
+                    out.append("return (false);")
+                    break
+                self.count += 1
+                out += ["sp = m_progmem.as_addr(%s_code + %d);" % (name, i),
+                        "n = literal(sp, true);",
+                        "push(sp);",
+                        "push(n);"]
+                i = j + 1
+                continue
+            if c in ":`":
+                m = re.match(r"[A-Za-z][A-Za-z0-9]*", code[i:])
+                if not m:
+                    out.append("return (false);")
+                    break
+                ref = m.group(0)
+                i += len(ref)
+                if c == '`' and ref in self.words:
+                    self.count += 1
+                    out += self.flush(name, i - len(ref) - 1)
+                    out.append("if (!word_%s()) return (false);" % ref)
+                else:
+                    out.append("if (execute(F(%s)) != NULL) return (false);"
+                               % c_string(c + ref))
+                continue
+            if c == '{':
+                i, stmts = self.block(name, code, i)
+                out += stmts
+                if i is None:
+                    break
+                continue
+            if c == '_':
+                raise Unsupported("trap operation")
+            out.append("return (false);")
+            break
+        if top and out[-1:] != ["return (false);"]:
+            out += self.flush(name, len(code))
+        return out
+
+    def block(self, name, code, i):
+        """Compile block(s) starting at index i (after left brace) and
+        the control structure operation that follows, if any. Return
+        next index (or None on error) and statements."""
+        end = self.extent(code, i)
+        self.count += 1
+        if end is None:
+            return None, ["push(m_progmem.as_addr(%s_code + %d));" % (name, i),
+                          "return (false);"]
+        j = self.skip(code, end)
+        op = code[j] if j < len(code) else '\0'
+        if op == '{':
+            end2 = self.extent(code, j + 1)
+            k = self.skip(code, end2) if end2 is not None else len(code)
+            if k < len(code) and code[k] == 'e':
+                # Second block, separators and the operation
+                self.count += (j - end) + 1 + (k - end2) + 1
+                head = self.flush(name, k)
+                body = self.indent(self.compile(name, code, i, False))
+                other = self.indent(self.compile(name, code, j + 1, False))
+                return k + 1, (head + ["if (pop()) {"] + body + ["}", "else {"]
+                               + other + ["}"])
+        if op not in "iwxl":
+            return end, ["push(m_progmem.as_addr(%s_code + %d));" % (name, i),
+                         "len = %d;" % (end - i - 1)]
+
+        # Separators and the operation; the body counts its operations
+        self.count += j - end + 1
+        head = self.flush(name, j)
+        stmts = self.compile(name, code, i, False)
+        body = self.indent(stmts)
+        if op == 'i':
+            return j + 1, head + ["if (pop()) {"] + body + ["}"]
+        if op == 'w':
+            return j + 1, head + ["do {"] + body + ["} while (pop());"]
+        if op == 'x':
+            return j + 1, head + ["{"] + body + ["}"]
+        return j + 1, head + ["{",
+                              "  int high = pop();",
+                              "  int low = pop();",
+                              "  for (int i = low; i <= high; i++) {",
+                              "    push(i);"] + self.indent(stmts, 2) + ["  }", "}"]
+
+    def flush(self, name, i):
+        """Return statements that add the operations counted since the
+        last check to the operation counter and check the execution
+        limits with the given position, as the interpreter does every
+        256 operations."""
+        out = []
+        while self.count > 0:
+            n = min(self.count, 255)
+            out.append("if ((m_ticks += %d) < %d) tick(m_progmem.as_addr(%s_code + %d));"
+                       % (n, n, name, i))
+            self.count -= n
+        return out
+
+    def indent(self, stmts, level=1):
+        return ["  " * level + s for s in stmts]
+
+    def word(self, name, code):
+        """Compile script to member function. Return lines."""
+        self.count = 0
+        body = self.compile(name, code)
+        text = "\n".join(body)
+        locals = []
+        for var, decl in (("w", "int w;"), ("n", "int n;"), ("addr", "int addr;"),
+                          ("pin", "int pin;"), ("sp", "const char* sp;"),
+                          ("len", "size_t len = 0;")):
+            if re.search(r"\b%s\b" % var, text):
+                locals.append(decl)
+        lines = ["  bool word_%s()" % name, "  {"]
+        lines += ["    " + d for d in locals]
+        lines += ["    int* fp = m_fp;", ""]
+        lines += ["    " + s for s in body]
+        lines += ["    m_fp = fp;", "    return (true);", "  }"]
+        return lines
+
+
+def parse(path):
+    """Return list of (name, code) from given file."""
+    text = open(path).read()
+    words = []
+    for m in re.finditer(r'SCRIPT\(\s*(\w+)\s*,\s*"((?:[^"\\]|\\.)*)"\s*\)', text):
+        code = bytes(m.group(2), "utf-8").decode("unicode_escape")
+        words.append((m.group(1), code))
+    for line in text.splitlines():
+        m = re.match(r'\s*:([A-Za-z][A-Za-z0-9]*)\{(.*)\};\s*$', line)
+        if m:
+            words.append((m.group(1), m.group(2)))
+    return words
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Shell script compiler")
+    parser.add_argument("-b", "--base", default="Shell<>",
+                        help="shell base class (default Shell<>)")
+    parser.add_argument("-c", "--class", dest="cls", default="CompiledShell",
+                        help="generated class name (default CompiledShell)")
+    parser.add_argument("files", nargs="+")
+    args = parser.parse_args()
+
+    words = []
+    for path in args.files:
+        words += parse(path)
+
+    # Bind calls only to scripts that can be compiled
+    names = set(name for name, code in words)
+    while True:
+        compiler = Compiler(names)
+        compiled = set()
+        for name, code in words:
+            try:
+                compiler.word(name, code)
+                compiled.add(name)
+            except Unsupported:
+                pass
+        if compiled == names:
+            break
+        names = compiled
+    guard = re.sub(r"\W", "_", args.cls).upper() + "_H"
+
+    out = ["/**",
+           " * @file %s.h" % args.cls,
+           " * Generated by shellc.py from %s; do not edit." % ", ".join(args.files),
+           " */",
+           "",
+           "#ifndef %s" % guard,
+           "#define %s" % guard,
+           "",
+           "#include <Shell.h>",
+           ""]
+    for name, code in words:
+        out.append("SCRIPT(%s, %s);" % (name, c_string(code)))
+    out += ["",
+            "const script_t %s_scripts[] PROGMEM = {" % args.cls]
+    out += ["  SCRIPT_ENTRY(%s)," % name for name, code in words]
+    out += ["  SCRIPT_NULL()",
+            "};",
+            "",
+            "class %s : public %s {" % (args.cls, args.base),
+            "public:",
+            "  %s(Stream& ios) : %s(ios, %s_scripts), m_compiled(true) {}"
+            % (args.cls, args.base, args.cls),
+            "",
+            "  /**",
+            "   * Differential check; execute given script with the interpreter",
+            "   * only and then with the compiled scripts, and compare the",
+            "   * results; error and parameter stack. The parameter stack is",
+            "   * restored before the second run. Other state (variables,",
+            "   * eeprom, pins) is not, and the script should not depend on it.",
+            "   * Returns true if the results are the same.",
+            "   * @param[in] script.",
+            "   * @return bool.",
+            "   */",
+            "  bool check(const char* script)",
+            "  {",
+            "    const int N = sizeof(m_stack) / sizeof(m_stack[0]);",
+            "    int stack[N];",
+            "    int result[N];",
+            "    int* sp = m_sp;",
+            "    int tos = m_tos;",
+            "    memcpy(stack, m_stack, sizeof(stack));",
+            "",
+            "    // Interpret and save result",
+            "    m_compiled = false;",
+            "    bool failed = (execute(script) != NULL);",
+            "    m_compiled = true;",
+            "    int* res_sp = m_sp;",
+            "    int res_tos = m_tos;",
+            "    memcpy(result, m_stack, sizeof(result));",
+            "",
+            "    // Restore stack, run compiled and compare",
+            "    m_sp = sp;",
+            "    m_tos = tos;",
+            "    memcpy(m_stack, stack, sizeof(stack));",
+            "    if ((execute(script) != NULL) != failed) return (false);",
+            "    if (m_sp != res_sp || m_tos != res_tos) return (false);",
+            "    int n = depth();",
+            "    return (memcmp(m_sp, result + N - n, n * sizeof(int)) == 0);",
+            "  }",
+            "",
+            "protected:",
+            "  bool m_compiled;\t\t//!< Compiled scripts enabled.",
+            "",
+            "  virtual int native(int index)",
+            "  {",
+            "    if (!m_compiled) return (0);",
+            "    switch (index) {"]
+    functions = []
+    for i, (name, code) in enumerate(words):
+        try:
+            lines = compiler.word(name, code)
+        except Unsupported as e:
+            sys.stderr.write("shellc: %s: not compiled: %s\n" % (name, e))
+            continue
+        out.append("    case %d: return (word_%s() ? 1 : -1);" % (i, name))
+        functions += [""] + lines
+    out += ["    }",
+            "    return (0);",
+            "  }"]
+    out += functions
+    out += ["};", "", "#endif"]
+    print("\n".join(out))
+
+
+if __name__ == "__main__":
+    main()